@@ -0,0 +1,123 @@
+-- Times the per-DDL overhead of reading EVENTDATA() in git_trigger, before and after
+-- it was changed to shred the event XML once. Run it in a scratch database:
+--
+--   sqlcmd -S server -d scratch -i bench/trigger_overhead.sql
+--
+-- N is the number of CREATE OR ALTER PROCEDURE statements timed for each variant.
+-- Both triggers only read the event and write it to a table, so what's being measured
+-- is the XML handling and not gitsql itself. No trigger at all is timed as a baseline.
+--
+-- Results: none yet. This script has not been run - it was written without access to a
+-- SQL Server instance. Add the output here, with the server version, once it has been.
+
+:setvar N 1000
+
+SET NOCOUNT ON;
+
+IF OBJECT_ID('dbo.bench_sink') IS NOT NULL
+	DROP TABLE dbo.bench_sink;
+
+CREATE TABLE dbo.bench_sink (
+	type NVARCHAR(100),
+	tbl NVARCHAR(100),
+	[schema] NVARCHAR(100),
+	login NVARCHAR(100),
+	dbname NVARCHAR(100)
+);
+
+IF OBJECT_ID('tempdb..#results') IS NOT NULL
+	DROP TABLE #results;
+
+CREATE TABLE #results (
+	variant VARCHAR(20),
+	ms INT
+);
+GO
+
+CREATE OR ALTER PROCEDURE dbo.bench_run @variant VARCHAR(20), @n INT AS
+BEGIN
+	SET NOCOUNT ON;
+
+	DECLARE @i INT = 0, @start DATETIME2 = SYSDATETIME();
+
+	WHILE @i < @n
+	BEGIN
+		EXEC(N'CREATE OR ALTER PROCEDURE dbo.bench_target AS SELECT ' + CONVERT(NVARCHAR(10), @i) + N';');
+		SET @i += 1;
+	END;
+
+	INSERT INTO #results(variant, ms) VALUES(@variant, DATEDIFF(MILLISECOND, @start, SYSDATETIME()));
+END;
+GO
+
+IF EXISTS (SELECT * FROM sys.triggers WHERE name = 'bench_trigger' AND parent_class_desc = 'DATABASE')
+	DROP TRIGGER bench_trigger ON DATABASE;
+GO
+
+-- baseline
+
+EXEC dbo.bench_run 'none', $(N);
+GO
+
+-- before: one EVENTDATA().value() call per field
+
+CREATE TRIGGER bench_trigger ON DATABASE FOR DDL_PROCEDURE_EVENTS AS
+BEGIN
+	SET NOCOUNT ON;
+
+	DECLARE @type NVARCHAR(100), @tbl NVARCHAR(100), @schema NVARCHAR(100), @login NVARCHAR(100), @dbname NVARCHAR(100);
+
+	SELECT @type = EVENTDATA().value('(/EVENT_INSTANCE/EventType)[1]','nvarchar(100)');
+	SELECT @tbl = EVENTDATA().value('(/EVENT_INSTANCE/ObjectName)[1]','nvarchar(100)');
+	SELECT @schema = EVENTDATA().value('(/EVENT_INSTANCE/SchemaName)[1]','nvarchar(100)');
+	SELECT @login = EVENTDATA().value('(/EVENT_INSTANCE/LoginName)[1]','nvarchar(100)');
+	SELECT @dbname = EVENTDATA().value('(/EVENT_INSTANCE/DatabaseName)[1]','nvarchar(100)');
+
+	INSERT INTO dbo.bench_sink VALUES(@type, @tbl, @schema, @login, @dbname);
+END;
+GO
+
+EXEC dbo.bench_run 'before', $(N);
+GO
+
+DROP TRIGGER bench_trigger ON DATABASE;
+GO
+
+-- after: EVENTDATA() copied once and shredded in one SELECT
+
+CREATE TRIGGER bench_trigger ON DATABASE FOR DDL_PROCEDURE_EVENTS AS
+BEGIN
+	SET NOCOUNT ON;
+
+	DECLARE @type NVARCHAR(100), @tbl NVARCHAR(100), @schema NVARCHAR(100), @login NVARCHAR(100), @dbname NVARCHAR(100);
+	DECLARE @event XML = EVENTDATA(), @objtype NVARCHAR(100), @targettype NVARCHAR(100), @target NVARCHAR(100), @newname NVARCHAR(100);
+
+	SELECT @type = e.value('(EventType)[1]','nvarchar(100)'),
+		@tbl = e.value('(ObjectName)[1]','nvarchar(100)'),
+		@schema = e.value('(SchemaName)[1]','nvarchar(100)'),
+		@login = e.value('(LoginName)[1]','nvarchar(100)'),
+		@dbname = e.value('(DatabaseName)[1]','nvarchar(100)'),
+		@objtype = e.value('(ObjectType)[1]','nvarchar(100)'),
+		@targettype = e.value('(TargetObjectType)[1]','nvarchar(100)'),
+		@target = e.value('(TargetObjectName)[1]','nvarchar(100)'),
+		@newname = e.value('(NewObjectName)[1]','nvarchar(100)')
+	FROM @event.nodes('/EVENT_INSTANCE') AS ev(e);
+
+	INSERT INTO dbo.bench_sink VALUES(@type, @tbl, @schema, @login, @dbname);
+END;
+GO
+
+EXEC dbo.bench_run 'after', $(N);
+GO
+
+DROP TRIGGER bench_trigger ON DATABASE;
+DROP PROCEDURE dbo.bench_target;
+DROP PROCEDURE dbo.bench_run;
+DROP TABLE dbo.bench_sink;
+
+SELECT variant,
+	ms,
+	CONVERT(DECIMAL(10,3), ms * 1000.0 / $(N)) AS us_per_ddl,
+	CONVERT(DECIMAL(10,3), (ms - (SELECT ms FROM #results WHERE variant = 'none')) * 1000.0 / $(N)) AS trigger_us_per_ddl
+FROM #results;
+GO
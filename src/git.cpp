@@ -4,6 +4,9 @@
 #include <iostream>
 #include <unordered_set>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <memory>
 #include <zlib.h>
 #include <libssh/libssh.h>
 #include "git.h"
@@ -255,8 +258,9 @@ git_oid GitRepo::blob_create_from_buffer(span<const uint8_t> data) {
 			c = '\\';
 	}
 
+	// unique to this thread, as other threads may be writing blobs at the same time
 	filesystem::path tmpfile = repopath;
-	tmpfile /= "newblob";
+	tmpfile /= format("newblob.{}.{}", GetCurrentProcessId(), GetCurrentThreadId());
 
 	unique_handle h{CreateFileW((WCHAR*)tmpfile.u16string().c_str(), FILE_WRITE_DATA | DELETE, 0, nullptr, CREATE_ALWAYS,
 								FILE_ATTRIBUTE_NORMAL, nullptr)};
@@ -340,17 +344,112 @@ git_oid GitRepo::blob_create_from_buffer(span<const uint8_t> data) {
 	auto blobfile = get_object_filename(repopath, blob);
 
 #ifdef _WIN32
-	rename_open_file(h.get(), blobfile);
+	try {
+		rename_open_file(h.get(), blobfile);
+	} catch (...) {
+		// another thread may have written the same blob in the meantime
+		if (!filesystem::exists(blobfile))
+			throw;
+
+		FILE_DISPOSITION_INFO fdi;
+
+		fdi.DeleteFile = true;
+		SetFileInformationByHandle(h.get(), FileDispositionInfo, &fdi, sizeof(fdi));
+	}
 #else
 	string procfile = "/proc/self/fd/" + to_string(h.get());
 
-	if (linkat(AT_FDCWD, procfile.c_str(), AT_FDCWD, blobfile.string().c_str(), AT_SYMLINK_FOLLOW) == -1)
+	// EEXIST means another thread has written the same blob in the meantime
+	if (linkat(AT_FDCWD, procfile.c_str(), AT_FDCWD, blobfile.string().c_str(), AT_SYMLINK_FOLLOW) == -1 && errno != EEXIST)
 		throw errno_error("linkat", errno);
 #endif
 
 	return blob;
 }
 
+// gzip format, so that SQL Server's DECOMPRESS can read it too
+string gzip(string_view data) {
+	z_stream strm;
+	int err;
+	string ret;
+
+	memset(&strm, 0, sizeof(strm));
+
+	err = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY);
+	if (err != Z_OK)
+		throw formatted_error("deflateInit2 failed (error {})", err);
+
+	ret.resize(deflateBound(&strm, (uLong)data.size()));
+
+	strm.next_in = (unsigned char*)data.data();
+	strm.avail_in = (unsigned int)data.size();
+	strm.next_out = (unsigned char*)ret.data();
+	strm.avail_out = (unsigned int)ret.size();
+
+	err = deflate(&strm, Z_FINISH);
+
+	if (err != Z_STREAM_END) {
+		deflateEnd(&strm);
+		throw formatted_error("deflate returned {}", err);
+	}
+
+	ret.resize(strm.total_out);
+
+	deflateEnd(&strm);
+
+	return ret;
+}
+
+// accepts both gzip (from COMPRESS) and zlib streams
+string gunzip(span<const uint8_t> data) {
+	z_stream strm;
+	int err;
+	string ret;
+	uint8_t buf[16384];
+
+	memset(&strm, 0, sizeof(strm));
+
+	err = inflateInit2(&strm, 15 + 32);
+	if (err != Z_OK)
+		throw formatted_error("inflateInit2 failed (error {})", err);
+
+	// gzip trailer has the uncompressed size modulo 2^32 - but only trust it as far as a
+	// plausible compression ratio, in case the data's corrupt. zlib streams have an adler32
+	// there instead.
+	if (data.size() >= 18 && data[0] == 0x1f && data[1] == 0x8b) {
+		auto p = data.data() + data.size() - sizeof(uint32_t);
+		auto size = (size_t)p[0] | ((size_t)p[1] << 8) | ((size_t)p[2] << 16) | ((size_t)p[3] << 24);
+
+		ret.reserve(min(size, data.size() * 16));
+	}
+
+	strm.next_in = (unsigned char*)data.data();
+	strm.avail_in = (unsigned int)data.size();
+
+	do {
+		strm.next_out = buf;
+		strm.avail_out = sizeof(buf);
+
+		err = inflate(&strm, Z_NO_FLUSH);
+
+		if (err != Z_OK && err != Z_STREAM_END) {
+			inflateEnd(&strm);
+			throw formatted_error("inflate returned {}", err);
+		}
+
+		ret.append((char*)buf, sizeof(buf) - strm.avail_out);
+
+		if (err == Z_OK && strm.avail_in == 0 && strm.avail_out != 0) {
+			inflateEnd(&strm);
+			throw runtime_error("Compressed data was truncated.");
+		}
+	} while (err != Z_STREAM_END);
+
+	inflateEnd(&strm);
+
+	return ret;
+}
+
 git_oid GitRepo::tree_create_updated(const GitTree& baseline, span<const git_tree_update> updates) {
 	git_oid oid;
 
@@ -373,7 +472,8 @@ git_oid GitRepo::index_tree_id() const {
 	return tree_id;
 }
 
-static void update_git_no_parent(GitRepo& repo, const GitSignature& sig, const string& description, const list<git_file2>& files, const string& branch) {
+// Builds the tree for a commit with no parent, or returns nullopt if there's nothing in it.
+static optional<git_oid> root_tree(GitRepo& repo, const list<git_file2>& files) {
 	git_oid oid;
 
 	GitTree empty_tree(repo, repo.index_tree_id());
@@ -428,12 +528,21 @@ static void update_git_no_parent(GitRepo& repo, const GitSignature& sig, const s
 		}
 
 		if (upd.empty())
-			return;
+			return nullopt;
 
 		oid = repo.tree_create_updated(empty_tree, upd);
 	}
 
-	GitTree tree(repo, oid);
+	return oid;
+}
+
+static void update_git_no_parent(GitRepo& repo, const GitSignature& sig, const string& description, const list<git_file2>& files, const string& branch) {
+	auto oid = root_tree(repo, files);
+
+	if (!oid.has_value())
+		return;
+
+	GitTree tree(repo, oid.value());
 
 	auto commit_oid = repo.commit_create(sig, sig, description, tree);
 
@@ -490,22 +599,15 @@ void GitRepo::reference_create(const string& name, const git_oid& id, bool force
 		throw git_exception(ret, "git_reference_create");
 }
 
-void update_git(GitRepo& repo, const string& user, const string& email, const string& description, list<git_file2>& files,
-				bool clear_all, const optional<tds::datetimeoffset>& dto, const string& branch) {
-	GitSignature sig(user, email, dto);
-
-	git_oid parent_id;
-
-	bool parent_found = repo.reference_name_to_id(&parent_id, branch.empty() ? "refs/heads/master" : "refs/heads/" + branch);
-
-	if (!parent_found) {
-		update_git_no_parent(repo, sig, description, files, branch);
-		return;
-	}
+void GitRepo::reference_create_matching(const string& name, const git_oid& id, const git_oid& current_id, const string& log_message) {
+	git_reference_ptr ref;
 
-	auto parent = repo.commit_lookup(&parent_id);
+	if (auto ret = git_reference_create_matching(out_ptr(ref), repo.get(), name.c_str(), &id, 1, &current_id, log_message.c_str()))
+		throw git_exception(ret, "git_reference_create_matching");
+}
 
-	GitTree parent_tree(parent.get());
+// Builds the tree for a commit on top of parent_tree, or returns nullopt if nothing would change.
+static optional<git_oid> updated_tree(GitRepo& repo, GitTree& parent_tree, list<git_file2>& files, bool clear_all) {
 	git_oid oid;
 
 	if (clear_all) {
@@ -547,15 +649,40 @@ void update_git(GitRepo& repo, const string& user, const string& email, const st
 		}
 
 		if (upd.empty())
-			return;
+			return nullopt;
 
 		oid = repo.tree_create_updated(parent_tree, upd);
 	}
 
 	if (!memcmp(&oid, git_tree_id(parent_tree.tree.get()), sizeof(git_oid))) // no changes - avoid doing empty commit
+		return nullopt;
+
+	return oid;
+}
+
+void update_git(GitRepo& repo, const string& user, const string& email, const string& description, list<git_file2>& files,
+				bool clear_all, const optional<tds::datetimeoffset>& dto, const string& branch) {
+	GitSignature sig(user, email, dto);
+
+	git_oid parent_id;
+
+	bool parent_found = repo.reference_name_to_id(&parent_id, branch.empty() ? "refs/heads/master" : "refs/heads/" + branch);
+
+	if (!parent_found) {
+		update_git_no_parent(repo, sig, description, files, branch);
+		return;
+	}
+
+	auto parent = repo.commit_lookup(&parent_id);
+
+	GitTree parent_tree(parent.get());
+
+	auto oid = updated_tree(repo, parent_tree, files, clear_all);
+
+	if (!oid.has_value())
 		return;
 
-	GitTree tree(repo, oid);
+	GitTree tree(repo, oid.value());
 
 	auto commit_oid = repo.commit_create(sig, sig, description, tree, parent.get());
 
@@ -563,6 +690,57 @@ void update_git(GitRepo& repo, const string& user, const string& email, const st
 						  commit_oid, true, "branch updated");
 }
 
+commit_chain::commit_chain(GitRepo& repo, const string& branch) :
+	repo(repo), ref(branch.empty() ? "refs/heads/master" : "refs/heads/" + branch) {
+	git_oid oid;
+
+	if (!repo.reference_name_to_id(&oid, ref))
+		return;
+
+	start = tip_id = oid;
+	tip = repo.commit_lookup(&oid);
+	tip_tree.emplace(tip.get());
+}
+
+void commit_chain::add(const string& user, const string& email, const string& description, list<git_file2>& files,
+					   bool clear_all, const optional<tds::datetimeoffset>& dto) {
+	GitSignature sig(user, email, dto);
+	optional<git_oid> oid;
+
+	if (tip)
+		oid = updated_tree(repo, tip_tree.value(), files, clear_all);
+	else
+		oid = root_tree(repo, files);
+
+	if (!oid.has_value())
+		return;
+
+	GitTree tree(repo, oid.value());
+
+	tip_id = repo.commit_create(sig, sig, description, tree, tip.get());
+	tip = repo.commit_lookup(&tip_id.value());
+	tip_tree.emplace(move(tree));
+	commits++;
+}
+
+bool commit_chain::finish() {
+	if (commits == 0)
+		return false;
+
+	auto msg = format("gitsql: {} commit{}", commits, commits == 1 ? "" : "s");
+
+	// fails rather than losing anything if someone else has moved the branch in the meantime
+	if (start.has_value())
+		repo.reference_create_matching(ref, tip_id.value(), start.value(), msg);
+	else
+		repo.reference_create(ref, tip_id.value(), false, msg);
+
+	start = tip_id;
+	commits = 0;
+
+	return true;
+}
+
 GitIndex::GitIndex(const GitRepo& repo) {
 	if (auto ret = git_repository_index(out_ptr(index), repo.repo.get()))
 		throw git_exception(ret, "git_repository_index");
@@ -630,6 +808,65 @@ void GitRepo::checkout_head(const git_checkout_options* opts) {
 		throw git_exception(ret, "git_checkout_head");
 }
 
+// Forcibly checks out the files which differ between old_commit and HEAD, so that libgit2 doesn't
+// have to look at everything in the working directory. Without an old commit we check out the lot.
+void GitRepo::checkout_head_changes(const optional<git_oid>& old_commit) {
+	git_checkout_options opts;
+	vector<string> paths;
+	vector<char*> v;
+
+	if (git_checkout_options_init(&opts, GIT_CHECKOUT_OPTIONS_VERSION))
+		throw runtime_error("git_checkout_options_init failed");
+
+	opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+
+	if (!old_commit.has_value()) {
+		checkout_head(&opts);
+		return;
+	}
+
+	git_oid head;
+
+	if (!reference_name_to_id(&head, "HEAD"))
+		return;
+
+	if (git_oid_equal(&head, &old_commit.value()))
+		return;
+
+	auto old_c = commit_lookup(&old_commit.value());
+	auto new_c = commit_lookup(&head);
+	GitTree old_tree(old_c.get()), new_tree(new_c.get());
+	git_diff_ptr diff;
+
+	if (auto ret = git_diff_tree_to_tree(out_ptr(diff), repo.get(), old_tree.tree.get(), new_tree.tree.get(), nullptr))
+		throw git_exception(ret, "git_diff_tree_to_tree");
+
+	auto num_deltas = git_diff_num_deltas(diff.get());
+
+	if (num_deltas == 0)
+		return;
+
+	paths.reserve(num_deltas);
+
+	for (size_t i = 0; i < num_deltas; i++) {
+		auto delta = git_diff_get_delta(diff.get(), i);
+
+		paths.emplace_back(delta->new_file.path);
+	}
+
+	v.reserve(paths.size());
+
+	for (auto& p : paths) {
+		v.push_back(p.data());
+	}
+
+	opts.checkout_strategy |= GIT_CHECKOUT_DISABLE_PATHSPEC_MATCH;
+	opts.paths.strings = v.data();
+	opts.paths.count = v.size();
+
+	checkout_head(&opts);
+}
+
 bool GitRepo::branch_is_head(const std::string& name) {
 	git_reference_ptr ref;
 
@@ -850,7 +1087,39 @@ static vector<pair<string, string>> load_ssh_keys(const optional<string>& identi
 	return keys;
 }
 
-void GitRepo::try_push(const string& ref) {
+// Keys and ssh config are read the first time we push to a host, then kept for the rest of
+// the process, along with which key worked last time.
+struct ssh_host {
+	optional<string> user;
+	vector<pair<string, string>> keys;
+	optional<size_t> good_key;
+};
+
+static mutex ssh_hosts_lock;
+static map<string, shared_ptr<ssh_host>> ssh_hosts;
+
+static shared_ptr<ssh_host> get_ssh_host(const string& host) {
+	lock_guard lg(ssh_hosts_lock);
+
+	if (auto f = ssh_hosts.find(host); f != ssh_hosts.end())
+		return f->second;
+
+	auto h = make_shared<ssh_host>();
+	optional<string> identity;
+
+	get_ssh_settings(host, identity, h->user);
+
+	h->keys = load_ssh_keys(identity);
+
+	if (h->keys.empty())
+		throw runtime_error("No SSH keys loaded.");
+
+	ssh_hosts.emplace(host, h);
+
+	return h;
+}
+
+void GitRepo::try_push(const string& ref, unsigned int timeout) {
 	auto remote = branch_upstream_remote(ref);
 
 	if (remote.empty())
@@ -876,24 +1145,43 @@ void GitRepo::try_push(const string& ref) {
 		url = url.substr(at + 1);
 
 	git_push_options options = GIT_PUSH_OPTIONS_INIT;
-	optional<string> identity, user;
-
-	get_ssh_settings(url, identity, user);
-
-	auto keys = load_ssh_keys(identity);
 
-	if (keys.empty())
-		throw runtime_error("No SSH keys loaded.");
+	auto host = get_ssh_host(url);
 
 	struct options_payload {
 		optional<string> status;
-		vector<pair<string, string>> keys;
-		optional<string> user;
+		const ssh_host* host;
+		vector<size_t> key_order;
 		unsigned int key_num = 0;
+		optional<chrono::steady_clock::time_point> deadline;
+		bool timed_out = false;
+
+		bool expired() {
+			if (deadline.has_value() && chrono::steady_clock::now() >= deadline.value())
+				timed_out = true;
+
+			return timed_out;
+		}
 	} p;
 
-	swap(p.keys, keys);
-	swap(p.user, user);
+	p.host = host.get();
+
+	if (timeout != 0)
+		p.deadline = chrono::steady_clock::now() + chrono::seconds{timeout};
+
+	// try the key which worked last time first
+
+	{
+		lock_guard lg(ssh_hosts_lock);
+
+		if (host->good_key.has_value())
+			p.key_order.push_back(host->good_key.value());
+
+		for (size_t i = 0; i < host->keys.size(); i++) {
+			if (i != host->good_key)
+				p.key_order.push_back(i);
+		}
+	}
 
 	options.callbacks.payload = &p;
 
@@ -901,9 +1189,12 @@ void GitRepo::try_push(const string& ref) {
 									   unsigned int allowed_types, void* payload) -> int {
 		auto& p = *(options_payload*)payload;
 
+		if (p.expired())
+			return GIT_EUSER;
+
 		if (allowed_types & GIT_CREDENTIAL_USERNAME) {
-			if (p.user.has_value())
-				return git_credential_username_new(out, p.user.value().c_str());
+			if (p.host->user.has_value())
+				return git_credential_username_new(out, p.host->user.value().c_str());
 			else {
 #ifdef _WIN32
 				const char* username = getenv("USERNAME");
@@ -921,17 +1212,34 @@ void GitRepo::try_push(const string& ref) {
 		if (!(allowed_types & GIT_CREDENTIAL_SSH_MEMORY))
 			return GIT_PASSTHROUGH;
 
-		if (p.key_num == p.keys.size())
+		if (p.key_num == p.key_order.size())
 			return GIT_EAUTH;
 
-		auto ret = git_credential_ssh_key_memory_new(out, username_from_url, p.keys[p.key_num].first.c_str(),
-													 p.keys[p.key_num].second.c_str(), "");
+		const auto& key = p.host->keys[p.key_order[p.key_num]];
+
+		auto ret = git_credential_ssh_key_memory_new(out, username_from_url, key.first.c_str(),
+													 key.second.c_str(), "");
 
 		p.key_num++;
 
 		return ret;
 	};
 
+	// libgit2 calls these regularly while the push is progressing, which gives us the chance to
+	// give up on it - GIT_OPT_SET_SERVER_TIMEOUT covers the case where the remote stops responding
+
+	options.callbacks.sideband_progress = [](const char*, int, void* payload) -> int {
+		return ((options_payload*)payload)->expired() ? GIT_EUSER : 0;
+	};
+
+	options.callbacks.pack_progress = [](int, uint32_t, uint32_t, void* payload) -> int {
+		return ((options_payload*)payload)->expired() ? GIT_EUSER : 0;
+	};
+
+	options.callbacks.push_transfer_progress = [](unsigned int, unsigned int, size_t, void* payload) -> int {
+		return ((options_payload*)payload)->expired() ? GIT_EUSER : 0;
+	};
+
 	options.callbacks.push_update_reference = [](const char*, const char* status, void* payload) -> int {
 		auto& p = *(options_payload*)payload;
 
@@ -941,17 +1249,66 @@ void GitRepo::try_push(const string& ref) {
 		return 0;
 	};
 
-	r.push({ ref }, options);
+	try {
+		r.push({ ref }, options);
+	} catch (...) {
+		if (p.timed_out)
+			throw runtime_error("push timed out after " + to_string(timeout) + " seconds");
+
+		throw;
+	}
 
 	if (p.status.has_value())
 		throw runtime_error("push failed: " + p.status.value());
+
+	if (p.key_num > 0) {
+		lock_guard lg(ssh_hosts_lock);
+
+		host->good_key = p.key_order[p.key_num - 1];
+	}
 }
 
 void git_update::add_file(string_view filename, string_view data) {
+	add_file(filename, string{data});
+}
+
+void git_update::add_file(string_view filename, string&& data) {
+	enqueue(filename, git_file_data{move(data)});
+}
+
+void git_update::add_file(string_view filename, vector<uint8_t>&& data) {
+	enqueue(filename, git_file_data{move(data)});
+}
+
+void git_update::enqueue(string_view filename, git_file_data&& data) {
+	auto size = visit([](const auto& d) { return d.size(); }, data);
+
+	{
+		unique_lock ul(lock);
+
+		if (queued > 0 && queued + size > max_queued && !teptr) {
+			auto start = chrono::steady_clock::now();
+
+			// if the writer has died, stop() will rethrow its exception
+			space_cv.wait(ul, [&]{ return queued == 0 || queued + size <= max_queued || teptr; });
+
+			stalls++;
+			stall_time += chrono::steady_clock::now() - start;
+		}
+
+		files.emplace_back(filename, move(data));
+		queued += size;
+		high_water = max(high_water, queued);
+	}
+
+	cv.notify_one();
+}
+
+void git_update::remove_file(string_view filename) {
 	{
 		lock_guard lg(lock);
 
-		files.emplace_back(filename, data);
+		files.emplace_back(filename, nullopt);
 	}
 
 	cv.notify_one();
@@ -978,14 +1335,28 @@ void git_update::run(stop_token st) noexcept {
 
 				local_files.pop_front();
 
-				if (f.data.has_value())
-					files2.emplace_back(f.filename, repo.blob_create_from_buffer(f.data.value()));
-				else
+				if (f.data.has_value()) {
+					files2.emplace_back(f.filename, repo.blob_create_from_buffer(f.contents()));
+
+					{
+						lock_guard lg(lock);
+
+						queued -= f.contents().size();
+					}
+
+					space_cv.notify_one();
+				} else
 					files2.emplace_back(f.filename, nullopt);
 			}
 		} while (true);
 	} catch (...) {
-		teptr = current_exception();
+		{
+			lock_guard lg(lock);
+
+			teptr = current_exception();
+		}
+
+		space_cv.notify_all();
 	}
 }
 
@@ -999,6 +1370,12 @@ void git_update::stop() {
 	t.request_stop();
 	t.join();
 
+	if (stalls > 0) {
+		cerr << format("Blob queue was full {} time{}, waiting {:.1f}s in all (peak {} KiB, limit {} KiB).",
+					   stalls, stalls == 1 ? "" : "s", chrono::duration<double>(stall_time).count(),
+					   high_water / 1024, max_queued / 1024) << endl;
+	}
+
 	if (teptr)
 		rethrow_exception(teptr);
 }
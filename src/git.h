@@ -8,10 +8,14 @@
 #include <string>
 #include <list>
 #include <optional>
+#include <variant>
+#include <vector>
+#include <span>
 #include <filesystem>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 #include <time.h>
 #include <tdscpp.h>
 
@@ -129,6 +133,17 @@ public:
 
 using git_odb_ptr = std::unique_ptr<git_odb*, git_odb_deleter>;
 
+class git_diff_deleter {
+public:
+	using pointer = git_diff*;
+
+	void operator()(git_diff* d) {
+		git_diff_free(d);
+	}
+};
+
+using git_diff_ptr = std::unique_ptr<git_diff*, git_diff_deleter>;
+
 class GitSignature {
 public:
 	GitSignature(const std::string& user, const std::string& email, const std::optional<tds::datetimeoffset>& dto = std::nullopt);
@@ -167,14 +182,17 @@ public:
 	git_oid tree_create_updated(const GitTree& baseline, std::span<const git_tree_update> updates);
 	git_oid index_tree_id() const;
 	void checkout_head(const git_checkout_options* opts = nullptr);
+	void checkout_head_changes(const std::optional<git_oid>& old_commit);
 	git_reference_ptr branch_lookup(const std::string& branch_name, git_branch_t branch_type);
 	void branch_create(const std::string& branch_name, const git_commit* target, bool force);
 	void reference_create(const std::string& name, const git_oid& id, bool force, const std::string& log_message);
+	void reference_create_matching(const std::string& name, const git_oid& id, const git_oid& current_id,
+								   const std::string& log_message);
 	bool branch_is_head(const std::string& name);
 	bool is_bare();
 	std::string branch_upstream_remote(const std::string& refname);
 	GitRemote remote_lookup(const std::string& name);
-	void try_push(const std::string& ref);
+	void try_push(const std::string& ref, unsigned int timeout = 0);
 
 	git_oid blob_create_from_buffer(std::string_view data) {
 		return blob_create_from_buffer(std::span((uint8_t*)data.data(), data.size()));
@@ -218,17 +236,21 @@ public:
 	git_object_ptr obj;
 };
 
+// either something we've generated, or a buffer taken over from a tds::value
+using git_file_data = std::variant<std::string, std::vector<uint8_t>>;
+
 struct git_file {
-	git_file(std::string_view filename, const tds::value& data) : filename(filename) {
-		if (!data.is_null) {
-			this->data = "";
-			this->data.value().resize(data.val.size());
-			memcpy(this->data.value().data(), data.val.data(), data.val.size());
-		}
+	git_file(std::string_view filename, git_file_data&& data) : filename(filename), data(std::move(data)) { }
+	git_file(std::string_view filename, std::nullopt_t) : filename(filename) { }
+
+	std::span<const uint8_t> contents() const {
+		return std::visit([](const auto& d) {
+			return std::span((const uint8_t*)d.data(), d.size());
+		}, data.value());
 	}
 
 	std::string filename;
-	std::optional<std::string> data;
+	std::optional<git_file_data> data;
 };
 
 struct git_file2 {
@@ -240,21 +262,40 @@ struct git_file2 {
 	std::optional<git_oid> oid;
 };
 
+// add_file blocks while more than max_queued bytes are waiting to be written as blobs,
+// unless the queue is empty, so that a single large file can always get through. stop()
+// prints how often and for how long that happened, if it did.
+static const size_t default_max_queued = 64 * 1024 * 1024;
+
 struct git_update {
-	git_update(GitRepo& repo) : repo(repo) { }
+	// The worker thread gets its own handle on the repo, as libgit2 doesn't let one be
+	// shared between threads - the caller may be using theirs at the same time.
+	git_update(GitRepo& repo, size_t max_queued = default_max_queued) :
+		repo(git_repository_path(repo.repo.get())), max_queued(max_queued) { }
 
 	void add_file(std::string_view filename, std::string_view data);
+	void add_file(std::string_view filename, std::string&& data);
+	void add_file(std::string_view filename, std::vector<uint8_t>&& data);
+	void remove_file(std::string_view filename);
 	void run(std::stop_token st) noexcept;
 	void start();
 	void stop();
 
-	GitRepo& repo;
+	GitRepo repo;
+	size_t max_queued;
 	std::mutex lock;
-	std::condition_variable_any cv;
+	std::condition_variable_any cv, space_cv;
 	std::list<git_file> files;
 	std::list<git_file2> files2;
 	std::exception_ptr teptr;
 	std::jthread t;
+	size_t queued = 0; // bytes in files and not yet written
+	size_t high_water = 0;
+	unsigned int stalls = 0;
+	std::chrono::steady_clock::duration stall_time{};
+
+private:
+	void enqueue(std::string_view filename, git_file_data&& data);
 };
 
 #ifdef _WIN32
@@ -332,3 +373,28 @@ private:
 void update_git(GitRepo& repo, const std::string& user, const std::string& email, const std::string& description,
 				std::list<git_file2>& files, bool clear_all = false, const std::optional<tds::datetimeoffset>& dto = std::nullopt,
 				const std::string& branch = "");
+
+// Builds a run of commits on top of each other in memory, only moving the branch when finish() is called.
+class commit_chain {
+public:
+	commit_chain(GitRepo& repo, const std::string& branch);
+	void add(const std::string& user, const std::string& email, const std::string& description, std::list<git_file2>& files,
+			 bool clear_all = false, const std::optional<tds::datetimeoffset>& dto = std::nullopt);
+	bool finish();
+
+	GitTree* tree() {
+		return tip_tree.has_value() ? &tip_tree.value() : nullptr;
+	}
+
+	unsigned int pending() const {
+		return commits;
+	}
+
+private:
+	GitRepo& repo;
+	std::string ref;
+	std::optional<git_oid> start, tip_id;
+	git_commit_ptr tip;
+	std::optional<GitTree> tip_tree;
+	unsigned int commits = 0;
+};
@@ -14,11 +14,13 @@
 #include <vector>
 #include <list>
 #include <map>
+#include <unordered_map>
 #include <stdexcept>
 #include <filesystem>
 #include <span>
 #include <charconv>
 #include <iostream>
+#include <fstream>
 #include <tdscpp.h>
 #include <nlohmann/json.hpp>
 #include "git.h"
@@ -450,11 +452,12 @@ static string sanitize_fn(string_view fn) {
 }
 
 struct sql_obj {
-	sql_obj(string_view schema, string_view name, string_view def, string_view type = "", int64_t id = 0, bool has_perms = false, bool quoted_identifier = false) :
-		schema(schema), name(name), def(def), type(type), id(id), has_perms(has_perms), quoted_identifier(quoted_identifier) { }
+	sql_obj(string_view schema, string_view name, string_view type = "", int64_t id = 0, size_t def_size = 0, bool has_perms = false, bool quoted_identifier = false) :
+		schema(schema), name(name), type(type), id(id), def_size(def_size), has_perms(has_perms), quoted_identifier(quoted_identifier) { }
 
-	string schema, name, def, type;
+	string schema, name, type;
 	int64_t id;
+	size_t def_size; // DATALENGTH of the module definition, if it has one
 	bool has_perms;
 	bool quoted_identifier;
 };
@@ -487,16 +490,27 @@ static string grant_string(const vector<sql_perms>& perms, string_view obj) {
 
 		ret += " ON " + string(obj);
 		ret += " TO ";
-		ret += brackets_escape(p.user);
+		brackets_escape_append(ret, p.user);
 		ret += ";\n";
 	}
 
 	return ret;
 }
 
+// Owners are only given if they're not dbo, the default.
+static string owner_clause(tds::tds& tds, string_view sql, string_view name) {
+	tds::query sq(tds, tds::no_check{sql}, name);
+
+	if (!sq.fetch_row() || sq[0].is_null || (string)sq[0] == "dbo")
+		return "";
+
+	return " AUTHORIZATION " + brackets_escape((string)sq[0]);
+}
+
 static string get_schema_definition(tds::tds& tds, string_view name) {
 	vector<sql_perms> perms;
-	string ret = "CREATE SCHEMA " + brackets_escape(name) + ";\n";
+	string ret = "CREATE SCHEMA " + brackets_escape(name) +
+		owner_clause(tds, "SELECT USER_NAME(principal_id) FROM sys.schemas WHERE name = ?", name) + ";\n";
 
 	{
 		tds::query sq(tds, R"(SELECT database_permissions.state_desc,
@@ -541,7 +555,8 @@ static string get_role_definition(tds::tds& tds, string_view name, int64_t id) {
 	string ret;
 	bool first = true;
 
-	ret = "CREATE ROLE " + brackets_escape(name) + ";\n";
+	ret = "CREATE ROLE " + brackets_escape(name) +
+		owner_clause(tds, "SELECT USER_NAME(owning_principal_id) FROM sys.database_principals WHERE name = ? AND type = 'R'", name) + ";\n";
 
 	tds::query sq(tds, R"(SELECT database_principals.name
 FROM sys.database_role_members
@@ -744,6 +759,93 @@ ORDER BY USER_NAME(database_permissions.grantee_principal_id),
 	return "GO\n\n" + grant_string(perms, name);
 }
 
+// Permissions on the objects in ids (a JSON array), or on all objects if that's not set, in one query
+// rather than one per object.
+static unordered_map<int64_t, vector<sql_perms>> objects_perms(tds::tds& tds, const optional<string>& ids, string_view hint) {
+	unordered_map<int64_t, vector<sql_perms>> ret;
+	string sql = R"(SELECT database_permissions.major_id,
+	database_permissions.state_desc,
+	database_permissions.permission_name,
+	USER_NAME(database_permissions.grantee_principal_id)
+)";
+
+	if (ids.has_value())
+		sql += "FROM OPENJSON(?) ids\nJOIN sys.database_permissions" + string(hint) + " ON database_permissions.class_desc = 'OBJECT_OR_COLUMN' AND database_permissions.major_id = CONVERT(INT, ids.value)\n";
+	else
+		sql += "FROM sys.database_permissions" + string(hint) + "\n";
+
+	sql += "JOIN sys.database_principals" + string(hint) + R"( ON database_principals.principal_id = database_permissions.grantee_principal_id
+WHERE database_permissions.class_desc = 'OBJECT_OR_COLUMN'
+ORDER BY database_permissions.major_id,
+	USER_NAME(database_permissions.grantee_principal_id),
+	database_permissions.state_desc,
+	database_permissions.permission_name)";
+
+	auto read = [&](tds::query& sq) {
+		while (sq.fetch_row()) {
+			bool found = false;
+			auto& p = ret[(int64_t)sq[0]];
+			auto type = (string)sq[1];
+			auto user = (string)sq[3];
+
+			for (auto& p2 : p) {
+				if (p2.user == user && p2.type == type) {
+					p2.perms.emplace_back((string)sq[2]);
+					found = true;
+					break;
+				}
+			}
+
+			if (!found)
+				p.emplace_back(user, type, (string)sq[2]);
+		}
+	};
+
+	if (ids.has_value()) {
+		tds::query sq(tds, tds::no_check{sql}, ids.value());
+
+		read(sq);
+	} else {
+		tds::query sq(tds, tds::no_check{sql});
+
+		read(sq);
+	}
+
+	return ret;
+}
+
+// Replaces the GRANT and DENY statements which object_perms puts at the end of a file, after the last GO.
+static string splice_perms(string_view ddl, string_view grants) {
+	auto body = ddl;
+
+	if (auto pos = ddl.rfind("GO\n\n"); pos != string::npos && (pos == 0 || ddl[pos - 1] == '\n')) {
+		auto tail = ddl.substr(pos + 4);
+		bool only_grants = !tail.empty();
+
+		while (!tail.empty()) {
+			auto nl = tail.find('\n');
+			auto line = tail.substr(0, nl);
+
+			if (!line.starts_with("GRANT") && !line.starts_with("DENY")) {
+				only_grants = false;
+				break;
+			}
+
+			tail = nl == string::npos ? string_view{} : tail.substr(nl + 1);
+		}
+
+		if (only_grants)
+			body = ddl.substr(0, pos);
+	}
+
+	string ret{body};
+
+	if (!grants.empty())
+		ret += "GO\n\n" + string(grants);
+
+	return ret;
+}
+
 static string fix_whitespace(string_view sv) {
 	string s;
 
@@ -772,6 +874,27 @@ static string fix_whitespace(string_view sv) {
 	return s;
 }
 
+static string tidy_ddl(string_view sv) {
+	auto ddl = fix_whitespace(sv);
+
+	if (!ddl.empty() && ddl.front() == '\n') {
+		auto pos = ddl.find_first_not_of("\n");
+
+		if (pos == string::npos)
+			ddl.clear();
+		else
+			ddl = ddl.substr(pos);
+	}
+
+	while (!ddl.empty() && (ddl.back() == '\n' || ddl.back() == ' ')) {
+		ddl.pop_back();
+	}
+
+	ddl += "\n";
+
+	return ddl;
+}
+
 #ifdef _WIN32
 static unique_handle open_process_token(HANDLE process_handle, DWORD desired_access) {
 	HANDLE h;
@@ -888,7 +1011,8 @@ void get_current_user_details(string& name, string& email) {
 #endif
 }
 
-static void dump_partition_functions(tds::tds& tds, git_update& gu) {
+// Returns pairs of name and DDL - if name is set, only for that function.
+static vector<pair<string, string>> partition_functions_ddl(tds::tds& tds, const optional<string>& name) {
 	struct partfunc {
 		partfunc(int32_t id, string_view name, bool boundary_value_on_right, string_view type, int max_length,
 				 int precision, int scale, string_view collation_name) :
@@ -908,6 +1032,7 @@ static void dump_partition_functions(tds::tds& tds, git_update& gu) {
 	};
 
 	vector<partfunc> funcs;
+	vector<pair<string, string>> ret;
 
 	{
 		tds::query sq(tds, R"(SELECT partition_functions.function_id,
@@ -923,7 +1048,8 @@ FROM sys.partition_functions
 JOIN sys.partition_parameters ON partition_parameters.function_id = partition_functions.function_id AND partition_parameters.parameter_id = 1
 JOIN sys.types ON types.user_type_id = partition_parameters.user_type_id
 LEFT JOIN sys.partition_range_values ON partition_range_values.function_id = partition_functions.function_id AND partition_range_values.parameter_id = 1
-ORDER BY partition_functions.function_id, partition_range_values.boundary_id)");
+WHERE ? IS NULL OR partition_functions.name = ?
+ORDER BY partition_functions.function_id, partition_range_values.boundary_id)", name, name);
 
 		while (sq.fetch_row()) {
 			auto function_id = (int32_t)sq[0];
@@ -942,7 +1068,7 @@ ORDER BY partition_functions.function_id, partition_range_values.boundary_id)");
 		string sql;
 
 		sql = "CREATE PARTITION FUNCTION ";
-		sql += brackets_escape(f.name);
+		brackets_escape_append(sql, f.name);
 		sql += "(";
 
 		sql += type_to_string(f.type, f.max_length, f.precision, f.scale);
@@ -966,11 +1092,20 @@ ORDER BY partition_functions.function_id, partition_range_values.boundary_id)");
 
 		sql += ");\n";
 
-		gu.add_file("partition_functions/" + f.name + ".sql", sql);
+		ret.emplace_back(f.name, move(sql));
 	}
+
+	return ret;
 }
 
-static void dump_partition_schemes(tds::tds& tds, git_update& gu) {
+static void dump_partition_functions(tds::tds& tds, git_update& gu) {
+	for (auto& f : partition_functions_ddl(tds, nullopt)) {
+		gu.add_file("partition_functions/" + f.first + ".sql", move(f.second));
+	}
+}
+
+// Returns pairs of name and DDL - if name is set, only for that scheme.
+static vector<pair<string, string>> partition_schemes_ddl(tds::tds& tds, const optional<string>& name) {
 	struct partscheme {
 		partscheme(int32_t id, string_view scheme_name, string_view func_name) :
 			id(id), scheme_name(scheme_name), func_name(func_name) {
@@ -983,6 +1118,7 @@ static void dump_partition_schemes(tds::tds& tds, git_update& gu) {
 	};
 
 	vector<partscheme> schemes;
+	vector<pair<string, string>> ret;
 
 	{
 		tds::query sq(tds, R"(SELECT partition_schemes.data_space_id, partition_schemes.name, partition_functions.name, data_spaces.name
@@ -990,7 +1126,8 @@ FROM sys.partition_schemes
 JOIN sys.partition_functions ON partition_functions.function_id = partition_schemes.function_id
 LEFT JOIN sys.destination_data_spaces ON destination_data_spaces.partition_scheme_id = partition_schemes.data_space_id
 LEFT JOIN sys.data_spaces ON data_spaces.data_space_id = destination_data_spaces.data_space_id
-ORDER BY partition_schemes.data_space_id, destination_data_spaces.destination_id)");
+WHERE ? IS NULL OR partition_schemes.name = ?
+ORDER BY partition_schemes.data_space_id, destination_data_spaces.destination_id)", name, name);
 
 		while (sq.fetch_row()) {
 			auto id = (int32_t)sq[0];
@@ -1007,9 +1144,9 @@ ORDER BY partition_schemes.data_space_id, destination_data_spaces.destination_id
 		string sql;
 
 		sql = "CREATE PARTITION SCHEME ";
-		sql += brackets_escape(s.scheme_name);
+		brackets_escape_append(sql, s.scheme_name);
 		sql += " AS PARTITION ";
-		sql += brackets_escape(s.func_name);
+		brackets_escape_append(sql, s.func_name);
 
 		bool all = false;
 		if (!s.dests.empty()) {
@@ -1030,7 +1167,7 @@ ORDER BY partition_schemes.data_space_id, destination_data_spaces.destination_id
 				if (!first)
 					sql += ", ";
 
-				sql += brackets_escape(d);
+				brackets_escape_append(sql, d);
 
 				first = false;
 			}
@@ -1038,7 +1175,15 @@ ORDER BY partition_schemes.data_space_id, destination_data_spaces.destination_id
 
 		sql += ");\n";
 
-		gu.add_file("partition_schemes/" + s.scheme_name + ".sql", sql);
+		ret.emplace_back(s.scheme_name, move(sql));
+	}
+
+	return ret;
+}
+
+static void dump_partition_schemes(tds::tds& tds, git_update& gu) {
+	for (auto& s : partition_schemes_ddl(tds, nullopt)) {
+		gu.add_file("partition_schemes/" + s.first + ".sql", move(s.second));
 	}
 }
 
@@ -1057,7 +1202,7 @@ static string pages_to_data_size(int32_t pages) {
 	return to_string(pages * 8) + " KB";
 }
 
-static void dump_filegroups(tds::tds& tds, git_update& gu) {
+static void dump_filegroups(tds::tds& tds, git_update& gu, string_view db) {
 	struct fg_file {
 		fg_file(string_view name, string_view physical_name, int32_t size, int32_t max_size, int32_t growth, bool is_percent_growth) :
 			name(name), physical_name(physical_name), size(size), max_size(max_size), growth(growth),
@@ -1083,10 +1228,10 @@ static void dump_filegroups(tds::tds& tds, git_update& gu) {
 	vector<fg> filegroups;
 
 	{
-		tds::query sq(tds, R"(SELECT filegroups.data_space_id, filegroups.name, database_files.name, database_files.physical_name, database_files.size, database_files.max_size, database_files.growth, database_files.is_percent_growth
+		tds::query sq(tds, R"(SELECT filegroups.data_space_id, filegroups.name, master_files.name, master_files.physical_name, master_files.size, master_files.max_size, master_files.growth, master_files.is_percent_growth
 FROM sys.filegroups
-JOIN sys.database_files ON database_files.data_space_id = filegroups.data_space_id
-ORDER BY filegroups.data_space_id, database_files.file_id)");
+JOIN sys.master_files ON master_files.database_id = DB_ID(?) AND master_files.data_space_id = filegroups.data_space_id
+ORDER BY filegroups.data_space_id, master_files.file_id)", db);
 
 		while (sq.fetch_row()) {
 			auto id = (int32_t)sq[0];
@@ -1102,13 +1247,13 @@ ORDER BY filegroups.data_space_id, database_files.file_id)");
 		string sql;
 
 		sql = "ALTER DATABASE ";
-		sql += brackets_escape(tds::utf16_to_utf8(tds.db_name()));
+		brackets_escape_append(sql, db);
 		sql += " ADD FILEGROUP ";
-		sql += brackets_escape(f.name);
+		brackets_escape_append(sql, f.name);
 		sql += ";\n\n";
 
 		sql += "ALTER DATABASE ";
-		sql += brackets_escape(tds::utf16_to_utf8(tds.db_name()));
+		brackets_escape_append(sql, db);
 		sql += " ADD FILE\n";
 
 		bool first = true;
@@ -1143,7 +1288,7 @@ ORDER BY filegroups.data_space_id, database_files.file_id)");
 	}
 }
 
-static void dump_log_files(tds::tds& tds, git_update& gu) {
+static void dump_log_files(tds::tds& tds, git_update& gu, string_view db) {
 	struct fg_file {
 		fg_file(string_view name, string_view physical_name, int32_t size, int32_t max_size, int32_t growth, bool is_percent_growth) :
 			name(name), physical_name(physical_name), size(size), max_size(max_size), growth(growth),
@@ -1162,8 +1307,8 @@ static void dump_log_files(tds::tds& tds, git_update& gu) {
 
 	{
 		tds::query sq(tds, R"(SELECT name, physical_name, size, max_size, growth, is_percent_growth
-FROM sys.database_files
-WHERE data_space_id = 0)");
+FROM sys.master_files
+WHERE database_id = DB_ID(?) AND data_space_id = 0)", db);
 
 		while (sq.fetch_row()) {
 			log_files.emplace_back((string)sq[0], (string)sq[1], (int32_t)sq[2], (int32_t)sq[3], (int32_t)sq[4], (unsigned int)sq[5] != 0);
@@ -1174,7 +1319,7 @@ WHERE data_space_id = 0)");
 		string sql;
 
 		sql = "ALTER DATABASE ";
-		sql += brackets_escape(tds::utf16_to_utf8(tds.db_name()));
+		brackets_escape_append(sql, db);
 		sql += " ADD LOG FILE (\n";
 
 		sql += "\tNAME = " + brackets_escape(l.name) + ",\n";
@@ -1197,11 +1342,11 @@ WHERE data_space_id = 0)");
 	}
 }
 
-static void dump_options(tds::tds& tds, git_update& gu) {
+static void dump_options(tds::tds& tds, git_update& gu, string_view db) {
 	auto j = json::object();
 
 	{
-		tds::batch sq(tds, "SELECT compatibility_level, collation_name, user_access, is_read_only, is_auto_close_on, is_auto_shrink_on, is_supplemental_logging_enabled, snapshot_isolation_state, is_read_committed_snapshot_on, recovery_model, page_verify_option, is_auto_create_stats_on, is_auto_create_stats_incremental_on, is_auto_update_stats_on, is_auto_update_stats_async_on, is_ansi_null_default_on, is_ansi_nulls_on, is_ansi_padding_on, is_ansi_warnings_on, is_arithabort_on, is_concat_null_yields_null_on, is_numeric_roundabort_on, is_quoted_identifier_on, is_recursive_triggers_on, is_cursor_close_on_commit_on, is_local_cursor_default, is_fulltext_enabled, is_trustworthy_on, is_db_chaining_on, is_parameterization_forced, is_master_key_encrypted_by_server, is_query_store_on, is_published, is_subscribed, is_merge_published, is_distributor, is_sync_with_backup, is_broker_enabled, is_date_correlation_on, is_cdc_enabled, is_encrypted, is_honor_broker_priority_on, containment, is_memory_optimized_elevate_to_snapshot_on FROM sys.databases WHERE database_id = DB_ID()");
+		tds::query sq(tds, "SELECT compatibility_level, collation_name, user_access, is_read_only, is_auto_close_on, is_auto_shrink_on, is_supplemental_logging_enabled, snapshot_isolation_state, is_read_committed_snapshot_on, recovery_model, page_verify_option, is_auto_create_stats_on, is_auto_create_stats_incremental_on, is_auto_update_stats_on, is_auto_update_stats_async_on, is_ansi_null_default_on, is_ansi_nulls_on, is_ansi_padding_on, is_ansi_warnings_on, is_arithabort_on, is_concat_null_yields_null_on, is_numeric_roundabort_on, is_quoted_identifier_on, is_recursive_triggers_on, is_cursor_close_on_commit_on, is_local_cursor_default, is_fulltext_enabled, is_trustworthy_on, is_db_chaining_on, is_parameterization_forced, is_master_key_encrypted_by_server, is_query_store_on, is_published, is_subscribed, is_merge_published, is_distributor, is_sync_with_backup, is_broker_enabled, is_date_correlation_on, is_cdc_enabled, is_encrypted, is_honor_broker_priority_on, containment, is_memory_optimized_elevate_to_snapshot_on FROM sys.databases WHERE database_id = DB_ID(?)", db);
 
 		if (!sq.fetch_row())
 			throw runtime_error("Unable to dump database options.");
@@ -1314,13 +1459,97 @@ static string synonym_ddl(tds::tds& tds, int64_t object_id, string_view schema,
 	return "CREATE SYNONYM " + brackets_escape(schema) + "." + brackets_escape(name) + " FOR " + base_object_name + ";";
 }
 
-void do_dump_sql(tds::tds& tds, git_update& gu) {
+static void dump_object(tds::tds& tds, git_update& gu, const sql_obj& obj, string&& def,
+						const unordered_map<int64_t, vector<sql_perms>>& perms) {
+	string filename = sanitize_fn(obj.schema) + "/";
+
+	if (obj.type == "V")
+		filename += "views/";
+	else if (obj.type == "P")
+		filename += "procedures/";
+	else if (obj.type == "FN" || obj.type == "TF" || obj.type == "IF")
+		filename += "functions/";
+	else if (obj.type == "U")
+		filename += "tables/";
+	else if (obj.type == "TT" || obj.type == "T")
+		filename += "types/";
+	else if (obj.type == "SN")
+		filename += "synonyms/";
+
+	if (obj.type == "U" || obj.type == "TT")
+		def = table_ddl(tds, obj.id, false);
+	else if (obj.type == "V")
+		def = munge_definition(def, obj.schema, obj.name, lex::VIEW);
+	else if (obj.type == "P")
+		def = munge_definition(def, obj.schema, obj.name, lex::PROCEDURE);
+	else if (obj.type == "FN" || obj.type == "TF" || obj.type == "IF")
+		def = munge_definition(def, obj.schema, obj.name, lex::FUNCTION);
+	else if (obj.type == "SN")
+		def = synonym_ddl(tds, obj.id, obj.schema, obj.name);
+
+	def = tidy_ddl(def);
+
+	if (obj.has_perms) {
+		if (auto f = perms.find(obj.id); f != perms.end())
+			def += "GO\n\n" + grant_string(f->second, brackets_escape(obj.schema) + "." + brackets_escape(obj.name));
+	}
+
+	if (obj.type == "P" && !obj.quoted_identifier)
+		def = "SET QUOTED_IDENTIFIER OFF;\nGO\n\n" + def;
+
+	filename += sanitize_fn(obj.name) + ".sql";
+
+	gu.add_file(filename, move(def));
+}
+
+// Module definitions are fetched in pages of about this many bytes, so that we only
+// hold a few of them at once rather than the whole database's.
+static const size_t dump_page_bytes = 4 * 1024 * 1024;
+
+static void dump_objects_page(tds::tds& tds, git_update& gu, span<const sql_obj> page,
+							  const unordered_map<int64_t, vector<sql_perms>>& perms) {
+	unordered_map<int64_t, string> defs;
+
+	{
+		auto ids = json::array();
+
+		for (const auto& obj : page) {
+			if (obj.def_size != 0)
+				ids.push_back(obj.id);
+		}
+
+		if (!ids.empty()) {
+			tds::query sq(tds, R"(SELECT sql_modules.object_id, sql_modules.definition
+FROM OPENJSON(?) ids
+JOIN sys.sql_modules ON sql_modules.object_id = CONVERT(INT, ids.value))", ids.dump());
+
+			while (sq.fetch_row()) {
+				defs.emplace((int64_t)sq[0], (string)sq[1]);
+			}
+		}
+	}
+
+	for (const auto& obj : page) {
+		string def;
+
+		if (auto f = defs.find(obj.id); f != defs.end()) {
+			def = move(f->second);
+			defs.erase(f);
+		}
+
+		dump_object(tds, gu, obj, move(def), perms);
+	}
+}
+
+void do_dump_sql(tds::tds& tds, git_update& gu, string_view db) {
 	vector<sql_obj> objs;
 
+	// Only list the objects to begin with - their definitions are fetched a page at a time below.
+
 	{
 		tds::query sq(tds, R"(SELECT schemas.name,
 	COALESCE(table_types.name, objects.name),
-	sql_modules.definition,
+	ISNULL(DATALENGTH(sql_modules.definition), 0),
 	RTRIM(objects.type),
 	objects.object_id,
 	CASE WHEN EXISTS (SELECT * FROM sys.database_permissions WHERE class_desc = 'OBJECT_OR_COLUMN' AND major_id = objects.object_id) THEN 1 ELSE 0 END,
@@ -1335,17 +1564,36 @@ WHERE objects.type IN ('V','P','FN','TF','IF','U','TT','SN') AND
 ORDER BY schemas.name, objects.name)");
 
 		while (sq.fetch_row()) {
-			objs.emplace_back((string)sq[0], (string)sq[1], (string)sq[2], (string)sq[3], (int64_t)sq[4],
+			objs.emplace_back((string)sq[0], (string)sq[1], (string)sq[3], (int64_t)sq[4], (size_t)(int64_t)sq[2],
 							  (unsigned int)sq[5] != 0, (unsigned int)sq[6] != 0);
 		}
 	}
 
 	{
-		tds::query sq(tds, "SELECT triggers.name, sql_modules.definition FROM sys.triggers LEFT JOIN sys.sql_modules ON sql_modules.object_id=triggers.object_id WHERE triggers.parent_class_desc = 'DATABASE'");
+		tds::query sq(tds, "SELECT triggers.name, triggers.object_id, ISNULL(DATALENGTH(sql_modules.definition), 0) FROM sys.triggers LEFT JOIN sys.sql_modules ON sql_modules.object_id=triggers.object_id WHERE triggers.parent_class_desc = 'DATABASE'");
 
 		while (sq.fetch_row()) {
-			objs.emplace_back("db_triggers", (string)sq[0], (string)sq[1]);
+			objs.emplace_back("db_triggers", (string)sq[0], "", (int64_t)sq[1], (size_t)(int64_t)sq[2]);
+		}
+	}
+
+	auto perms = objects_perms(tds, nullopt, "");
+
+	{
+		size_t start = 0, page_bytes = 0;
+
+		for (size_t i = 0; i < objs.size(); i++) {
+			if (i > start && page_bytes + objs[i].def_size > dump_page_bytes) {
+				dump_objects_page(tds, gu, span(objs).subspan(start, i - start), perms);
+				start = i;
+				page_bytes = 0;
+			}
+
+			page_bytes += objs[i].def_size;
 		}
+
+		if (start < objs.size())
+			dump_objects_page(tds, gu, span(objs).subspan(start), perms);
 	}
 
 	{
@@ -1360,7 +1608,7 @@ ORDER BY schemas.name, objects.name)");
 		}
 
 		for (const auto& v : schemas) {
-			objs.emplace_back("schemas", (string)v, get_schema_definition(tds, v));
+			dump_object(tds, gu, sql_obj{"schemas", v}, get_schema_definition(tds, v), perms);
 		}
 	}
 
@@ -1376,12 +1624,15 @@ ORDER BY schemas.name, objects.name)");
 		}
 
 		for (const auto& r : roles) {
-			objs.emplace_back("principals", r.first, get_role_definition(tds, r.first, r.second));
+			dump_object(tds, gu, sql_obj{"principals", r.first}, get_role_definition(tds, r.first, r.second), perms);
 		}
 	}
 
 	{
-		tds::query sq(tds, R"(SELECT name,
+		vector<pair<sql_obj, string>> types;
+
+		{
+			tds::query sq(tds, R"(SELECT name,
 	system_type_id,
 	SCHEMA_NAME(schema_id),
 	max_length,
@@ -1391,333 +1642,1185 @@ ORDER BY schemas.name, objects.name)");
 FROM sys.types
 WHERE is_user_defined = 1 AND is_table_type = 0)");
 
-		while (sq.fetch_row()) {
-			objs.emplace_back((string)sq[2], (string)sq[0], get_type_definition((string)sq[0], (string)sq[2], (int32_t)sq[1], (int16_t)sq[3], (uint8_t)sq[4], (uint8_t)sq[5], (unsigned int)sq[6] != 0), "T");
-		}
-	}
-
-	for (auto& obj : objs) {
-		string filename = sanitize_fn(obj.schema) + "/";
-
-		if (obj.type == "V")
-			filename += "views/";
-		else if (obj.type == "P")
-			filename += "procedures/";
-		else if (obj.type == "FN" || obj.type == "TF" || obj.type == "IF")
-			filename += "functions/";
-		else if (obj.type == "U")
-			filename += "tables/";
-		else if (obj.type == "TT" || obj.type == "T")
-			filename += "types/";
-		else if (obj.type == "SN")
-			filename += "synonyms/";
-
-		if (obj.type == "U" || obj.type == "TT")
-			obj.def = table_ddl(tds, obj.id, false);
-		else if (obj.type == "V")
-			obj.def = munge_definition(obj.def, obj.schema, obj.name, lex::VIEW);
-		else if (obj.type == "P")
-			obj.def = munge_definition(obj.def, obj.schema, obj.name, lex::PROCEDURE);
-		else if (obj.type == "FN" || obj.type == "TF" || obj.type == "IF")
-			obj.def = munge_definition(obj.def, obj.schema, obj.name, lex::FUNCTION);
-		else if (obj.type == "SN")
-			obj.def = synonym_ddl(tds, obj.id, obj.schema, obj.name);
-
-		obj.def = fix_whitespace(obj.def);
-
-		if (!obj.def.empty() && obj.def[0] == '\n') {
-			auto pos = obj.def.find_first_not_of("\n");
-
-			if (pos == string::npos)
-				obj.def.clear();
-			else
-				obj.def = obj.def.substr(pos);
+			while (sq.fetch_row()) {
+				types.emplace_back(sql_obj{(string)sq[2], (string)sq[0], "T"}, get_type_definition((string)sq[0], (string)sq[2], (int32_t)sq[1], (int16_t)sq[3], (uint8_t)sq[4], (uint8_t)sq[5], (unsigned int)sq[6] != 0));
+			}
 		}
 
-		while (!obj.def.empty() && (obj.def.back() == '\n' || obj.def.back() == ' ')) {
-			obj.def.pop_back();
+		for (auto& t : types) {
+			dump_object(tds, gu, t.first, move(t.second), perms);
 		}
-
-		obj.def += "\n";
-
-		if (obj.has_perms)
-			obj.def += object_perms(tds, obj.id, brackets_escape(obj.schema) + "." + brackets_escape(obj.name));
-
-		if (obj.type == "P" && !obj.quoted_identifier)
-			obj.def = "SET QUOTED_IDENTIFIER OFF;\nGO\n\n" + obj.def;
-
-		filename += sanitize_fn(obj.name) + ".sql";
-
-		gu.add_file(filename, obj.def);
 	}
 
 	dump_partition_functions(tds, gu);
 	dump_partition_schemes(tds, gu);
-	dump_filegroups(tds, gu);
-	dump_log_files(tds, gu);
-	dump_options(tds, gu);
-}
+	// The database name is passed in rather than taken from the connection, as
+	// we might be reading from a database snapshot. The files and options are
+	// those of the source database.
 
-static void dump_sql(tds::tds& tds, const filesystem::path& repo_dir, const string& branch) {
-	git_libgit2_init();
-	git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, false);
-	git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, 0);
-
-	GitRepo repo(repo_dir.string());
-	git_update gu(repo);
-	gu.start();
-
-	do_dump_sql(tds, gu);
-
-	gu.stop();
+	dump_filegroups(tds, gu, db);
+	dump_log_files(tds, gu, db);
+	dump_options(tds, gu, db);
+}
 
-	string name, email;
+static optional<git_oid> branch_commit(GitRepo& repo, const string& branch) {
+	git_oid oid;
 
-	get_current_user_details(name, email);
+	if (!repo.reference_name_to_id(&oid, "refs/heads/" + (branch.empty() ? "master" : branch)))
+		return nullopt;
 
-	update_git(repo, name, email, "Update", gu.files2, true, nullopt, branch);
+	return oid;
+}
 
-	if (!repo.is_bare() && repo.branch_is_head(branch)) {
-		git_checkout_options opts;
+// Only checking out what's changed since old_commit would never repair a working directory
+// which an earlier checkout failed to update, so if one fails we leave a note in the .git
+// directory, and the next time round check out everything.
+static filesystem::path checkout_failed_file(const GitRepo& repo) {
+	return filesystem::path{git_repository_path(repo.repo.get())} / "gitsql-checkout-failed";
+}
 
-		if (git_checkout_options_init(&opts, GIT_CHECKOUT_OPTIONS_VERSION))
-			throw runtime_error("git_checkout_options_init failed");
+static bool checkout_failed(const GitRepo& repo) {
+	error_code ec;
 
-		opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+	return filesystem::exists(checkout_failed_file(repo), ec);
+}
 
-		repo.checkout_head(&opts);
-	}
+static void update_working_dir(GitRepo& repo, const optional<git_oid>& old_commit) {
+	auto full = !old_commit.has_value() || checkout_failed(repo);
 
 	try {
-		repo.try_push("refs/heads/" + branch);
-	} catch (const exception& e) {
-		cerr << e.what() << endl;
-	}
-}
-
-static void get_user_details(const u16string& username, string& name, string& email) {
-#ifdef _WIN32
-	array<std::byte, 68> sid;
-	auto sidlen = (DWORD)sid.size();
-	char16_t domain[100];
-	DWORD domainlen = sizeof(domain) / sizeof(domain[0]);
-	SID_NAME_USE use;
-	auto u8username = tds::utf16_to_utf8(username);
+		repo.checkout_head_changes(full ? nullopt : old_commit);
+	} catch (...) {
+		ofstream f(checkout_failed_file(repo), ios::trunc);
 
-	if (!LookupAccountNameW(nullptr, (WCHAR*)username.c_str(), sid.data(), &sidlen,
-							(WCHAR*)domain, &domainlen, &use)) {
-		name = u8username;
-		email = u8username + "@localhost"s;
-		return;
+		throw;
 	}
 
-	try {
-		get_ldap_details_from_sid(sid.data(), name, email);
+	if (full) {
+		error_code ec;
 
-		if (name.empty())
-			name = u8username;
-	} catch (...) {
-		name = u8username;
-		email.clear();
+		filesystem::remove(checkout_failed_file(repo), ec);
 	}
+}
 
-	if (email.empty()) {
-		domain[domainlen] = 0;
+enum class dump_isolation {
+	none,
+	snapshot,
+	database_snapshot
+};
 
-		auto bs = u8username.find("\\");
+// Runs the whole dump in one SNAPSHOT transaction, so that it neither takes nor
+// waits for locks on user objects. SQL Server doesn't version metadata though,
+// so if an object is altered while we're running the dump will fail with
+// error 3961, rather than producing an inconsistent tree.
+static void do_dump_sql_snapshot(tds::tds& tds, git_update& gu, string_view db) {
+	{
+		tds::query sq(tds, "SELECT snapshot_isolation_state FROM sys.databases WHERE database_id = DB_ID()");
 
-		if (bs == string::npos)
-			email = u8username + "@"s + tds::utf16_to_utf8(domain);
-		else
-			email = u8username.substr(bs + 1) + "@"s + tds::utf16_to_utf8(domain);
+		if (!sq.fetch_row() || (unsigned int)sq[0] != 1)
+			throw formatted_error("Snapshot isolation is not enabled for {}. Either run ALTER DATABASE {} SET ALLOW_SNAPSHOT_ISOLATION ON, or use --db-snapshot instead.", db, brackets_escape(db));
 	}
-#else
-	auto u8username = tds::utf16_to_utf8(username);
+
+	tds.run("SET TRANSACTION ISOLATION LEVEL SNAPSHOT");
 
 	try {
-		get_ldap_details_from_full_name(u8username, name, email);
-	} catch (const exception& e) {
-		cerr << e.what() << endl;
+		tds::trans trans(tds);
 
-		name.clear();
-		email.clear();
+		do_dump_sql(tds, gu, db);
+
+		trans.commit();
 	} catch (...) {
-		name.clear();
-		email.clear();
+		tds.run("SET TRANSACTION ISOLATION LEVEL READ COMMITTED");
+		throw;
 	}
 
-	if (name.empty())
-		name = u8username;
-
-	if (email.empty())
-		email = u8username + "@localhost"; // FIXME - computer name?
-#endif
+	tds.run("SET TRANSACTION ISOLATION LEVEL READ COMMITTED");
 }
 
-static void flush_git(const string& db_server) {
-	struct repo {
-		repo(unsigned int id, string_view dir, string_view branch) :
-			id(id), dir(dir), branch(branch) { }
-
-		unsigned int id;
-		string dir;
-		string branch;
-	};
-
-	vector<repo> repos;
+// A database snapshot of the current database, which is dropped again when
+// this goes out of scope.
+class database_snapshot {
+public:
+	database_snapshot(tds::tds& tds, string_view source) : tds(tds), source(source) {
+		auto now = chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
 
-	git_libgit2_init();
-	git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, false);
-	git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, 0);
+		name = format("{}_gitsql_{}", source, now);
 
-	{
-		tds::tds tds(db_server, db_username, db_password, db_app);
-		tds.run("SET LOCK_TIMEOUT 0; SET XACT_ABORT ON; DELETE FROM master.dbo.git WHERE (SELECT COUNT(*) FROM master.dbo.git_files WHERE id = Git.id) = 0");
+		string sql = "CREATE DATABASE " + brackets_escape(name) + " ON ";
+		bool first = true;
 
 		{
-			tds::batch sq(tds, "SELECT git.repo, git_repo.dir, git_repo.branch FROM (SELECT repo FROM master.dbo.git GROUP BY repo) git JOIN master.dbo.git_repo ON git_repo.id = Git.repo");
+			tds::query sq(tds, "SELECT name, physical_name FROM sys.master_files WHERE database_id = DB_ID(?) AND type = 0 ORDER BY file_id", source);
 
 			while (sq.fetch_row()) {
-				repos.emplace_back((unsigned int)sq[0], (string)sq[1], (string)sq[2]);
-			}
+				if (!first)
+					sql += ", ";
 
-			if (repos.size() == 0)
-				return;
+				sql += "(NAME = " + brackets_escape((string)sq[0]) + ", FILENAME = " + tds::value{(string)sq[1] + "." + name + ".ss"}.to_literal() + ")";
+
+				first = false;
+			}
 		}
-	}
 
-	for (const auto& r : repos) {
-		GitRepo repo(r.dir);
+		if (first)
+			throw formatted_error("Could not find data files for database {}.", source);
 
-		while (true) {
-			tds::datetimeoffset dto;
-			string name, email, description;
-			list<git_file2> files;
-			bool clear_all = false;
-			list<unsigned int> delete_commits;
-			list<unsigned int> delete_files;
+		sql += " AS SNAPSHOT OF " + brackets_escape(source);
 
-			tds::tds tds(db_server, db_username, db_password, db_app);
+		tds.run(tds::no_check{sql});
+	}
 
-			tds.run("SET LOCK_TIMEOUT 0; SET XACT_ABORT ON;");
+	~database_snapshot() {
+		try {
+			tds.run(tds::no_check{"USE " + brackets_escape(source)});
+			tds.run(tds::no_check{"DROP DATABASE " + brackets_escape(name)});
+		} catch (const exception& e) {
+			cerr << format("Could not drop database snapshot {}: {}", name, e.what()) << endl;
+		}
+	}
 
-			// FIXME - get this working with git_update thread?
+	string name;
 
-			{
-				tds::trans trans(tds);
-				tds::query sq(tds, R"(SELECT
-	git.id,
-	git.username,
-	git.description,
-	git.dto,
-	git_files.file_id,
-	git_files.filename,
-	git_files.data
-FROM master.dbo.git
-JOIN master.dbo.git_files ON git_files.id = git.id
-WHERE git.id = (SELECT MIN(id) FROM master.dbo.git WHERE repo = ?) OR (git.tran_id = (SELECT tran_id FROM master.dbo.git WHERE id = (SELECT MIN(id) FROM master.dbo.git WHERE repo = ?)) AND git.repo = ?)
-ORDER BY git.id
-)", r.id, r.id, r.id);
+private:
+	tds::tds& tds;
+	string source;
+};
 
-				if (!sq.fetch_row())
-					break;
+static void dump_sql(tds::tds& tds, string_view db, const filesystem::path& repo_dir, const string& branch,
+					 dump_isolation isolation) {
+	git_libgit2_init();
+	git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, false);
+	git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, 0);
 
-				auto commit = (unsigned int)sq[0];
-				auto username = (u16string)sq[1];
-				description = (string)sq[2];
-				dto = (tds::datetimeoffset)sq[3];
+	GitRepo repo(repo_dir.string());
+	git_update gu(repo);
+	gu.start();
 
-				get_user_details(username, name, email);
+	switch (isolation) {
+		case dump_isolation::none:
+			do_dump_sql(tds, gu, db);
+			break;
 
-				delete_commits.push_back(commit);
+		case dump_isolation::snapshot:
+			do_dump_sql_snapshot(tds, gu, db);
+			break;
 
-				bool merged_trans = false;
+		case dump_isolation::database_snapshot: {
+			database_snapshot snap(tds, db);
 
-				do {
-					delete_files.push_back((unsigned int)sq[4]);
+			tds.run(tds::no_check{"USE " + brackets_escape(snap.name)});
 
-					if ((unsigned int)sq[0] != commit) {
-						if (!merged_trans) {
-							description += " (transaction)";
-							merged_trans = true;
-						}
+			do_dump_sql(tds, gu, db);
+			break;
+		}
+	}
+
+	gu.stop();
+
+	string name, email;
+
+	get_current_user_details(name, email);
+
+	update_git(repo, name, email, "Update", gu.files2, true, nullopt, branch);
+
+	// a dump replaces everything, so check out everything too
+	if (!repo.is_bare() && repo.branch_is_head(branch))
+		update_working_dir(repo, nullopt);
+
+	try {
+		repo.try_push("refs/heads/" + branch);
+	} catch (const exception& e) {
+		cerr << e.what() << endl;
+	}
+}
+
+static string object_ddl_body(tds::tds& tds, string_view type, string_view orig_ddl, int64_t id, u16string_view schema,
+							  u16string_view object, bool nolock) {
+	string ddl;
+
+	if (type == "U") // table
+		ddl = table_ddl(tds, id, nolock);
+	else if (type == "V")
+		ddl = munge_definition(orig_ddl, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object), lex::VIEW);
+	else if (type == "P")
+		ddl = munge_definition(orig_ddl, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object), lex::PROCEDURE);
+	else if (type == "FN" || type == "TF" || type == "IF")
+		ddl = munge_definition(orig_ddl, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object), lex::FUNCTION);
+	else if (type == "SN")
+		ddl = synonym_ddl(tds, id, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object));
+
+	return tidy_ddl(ddl);
+}
+
+static unordered_map<int64_t, string> objects_ddl(tds::tds& tds, span<const int64_t> ids, bool nolock) {
+	struct obj_info {
+		obj_info(int64_t id, u16string_view schema, u16string_view name, string_view type, string_view def) :
+			id(id), schema(schema), name(name), type(type), def(def) { }
+
+		int64_t id;
+		u16string schema, name;
+		string type, def;
+	};
+
+	vector<obj_info> objs;
+	unordered_map<int64_t, string> ret;
+	string hint;
+
+	if (ids.empty())
+		return ret;
+
+	if (nolock)
+		hint = " WITH (NOLOCK)";
+
+	auto ids_json = json::array();
+
+	for (auto id : ids) {
+		ids_json.push_back(id);
+	}
+
+	auto ids_str = ids_json.dump();
+
+	{
+		tds::query sq(tds, tds::no_check{R"(SELECT objects.object_id,
+	SCHEMA_NAME(objects.schema_id),
+	objects.name,
+	RTRIM(objects.type),
+	sql_modules.definition
+FROM OPENJSON(?) ids
+JOIN sys.objects)" + hint + R"( ON objects.object_id = CONVERT(INT, ids.value)
+LEFT JOIN sys.sql_modules)" + hint + R"( ON sql_modules.object_id = objects.object_id)"}, ids_str);
+
+		while (sq.fetch_row()) {
+			objs.emplace_back((int64_t)sq[0], (u16string)sq[1], (u16string)sq[2], (string)sq[3], (string)sq[4]);
+		}
+	}
+
+	auto perms = objects_perms(tds, ids_str, hint);
+
+	for (const auto& obj : objs) {
+		auto ddl = object_ddl_body(tds, obj.type, obj.def, obj.id, obj.schema, obj.name, nolock);
+
+		if (auto f = perms.find(obj.id); f != perms.end())
+			ddl += "GO\n\n" + grant_string(f->second, brackets_escape(tds::utf16_to_utf8(obj.schema)) + "." + brackets_escape(tds::utf16_to_utf8(obj.name)));
+
+		ret.emplace(obj.id, move(ddl));
+	}
+
+	return ret;
+}
+
+// The GRANT and DENY statements for each object in ids which still exists, or an empty string
+// if it has no permissions.
+static unordered_map<int64_t, string> objects_grants(tds::tds& tds, span<const int64_t> ids) {
+	vector<pair<int64_t, string>> names;
+	unordered_map<int64_t, string> ret;
+	auto ids_json = json::array();
+
+	for (auto id : ids) {
+		ids_json.push_back(id);
+	}
+
+	auto ids_str = ids_json.dump();
+
+	{
+		tds::query sq(tds, R"(SELECT objects.object_id, SCHEMA_NAME(objects.schema_id), objects.name
+FROM OPENJSON(?) ids
+JOIN sys.objects ON objects.object_id = CONVERT(INT, ids.value))", ids_str);
+
+		while (sq.fetch_row()) {
+			names.emplace_back((int64_t)sq[0], brackets_escape((string)sq[1]) + "." + brackets_escape((string)sq[2]));
+		}
+	}
+
+	auto perms = objects_perms(tds, ids_str, "");
+
+	for (const auto& n : names) {
+		string grants;
+
+		if (auto f = perms.find(n.first); f != perms.end())
+			grants = grant_string(f->second, n.second);
+
+		ret.emplace(n.first, move(grants));
+	}
+
+	return ret;
+}
+
+static void get_user_details(const u16string& username, string& name, string& email) {
+#ifdef _WIN32
+	array<std::byte, 68> sid;
+	auto sidlen = (DWORD)sid.size();
+	char16_t domain[100];
+	DWORD domainlen = sizeof(domain) / sizeof(domain[0]);
+	SID_NAME_USE use;
+	auto u8username = tds::utf16_to_utf8(username);
+
+	if (!LookupAccountNameW(nullptr, (WCHAR*)username.c_str(), sid.data(), &sidlen,
+							(WCHAR*)domain, &domainlen, &use)) {
+		name = u8username;
+		email = u8username + "@localhost"s;
+		return;
+	}
+
+	try {
+		get_ldap_details_from_sid(sid.data(), name, email);
+
+		if (name.empty())
+			name = u8username;
+	} catch (...) {
+		name = u8username;
+		email.clear();
+	}
+
+	if (email.empty()) {
+		domain[domainlen] = 0;
+
+		auto bs = u8username.find("\\");
+
+		if (bs == string::npos)
+			email = u8username + "@"s + tds::utf16_to_utf8(domain);
+		else
+			email = u8username.substr(bs + 1) + "@"s + tds::utf16_to_utf8(domain);
+	}
+#else
+	auto u8username = tds::utf16_to_utf8(username);
+
+	try {
+		get_ldap_details_from_full_name(u8username, name, email);
+	} catch (const exception& e) {
+		cerr << e.what() << endl;
+
+		name.clear();
+		email.clear();
+	} catch (...) {
+		name.clear();
+		email.clear();
+	}
+
+	if (name.empty())
+		name = u8username;
+
+	if (email.empty())
+		email = u8username + "@localhost"; // FIXME - computer name?
+#endif
+}
+
+struct pending_file {
+	pending_file(string_view filename) : filename(filename) { }
+
+	string filename;
+	optional<git_file_data> data;
+	optional<int64_t> object_id;
+	bool perms = false; // only the permissions of object_id have changed
+};
+
+// files waiting to be committed, in the order first seen - a later version of a file replaces the earlier one
+class pending_files {
+public:
+	pending_file& set(const string& filename) {
+		if (auto f = index.find(filename); f != index.end()) {
+			auto& pf = files[f->second];
+
+			pf.data.reset();
+			pf.object_id.reset();
+			pf.perms = false;
+
+			return pf;
+		}
+
+		index.emplace(filename, files.size());
+
+		return files.emplace_back(filename);
+	}
+
+	// A permissions change only rewrites the end of the file, so it's applied on top of any
+	// earlier version rather than replacing it. DDL generated at flush time will already have
+	// the new permissions.
+	void set_perms(const string& filename, int64_t object_id) {
+		if (auto f = index.find(filename); f != index.end()) {
+			auto& pf = files[f->second];
+
+			if (pf.data.has_value()) {
+				pf.object_id = object_id;
+				pf.perms = true;
+			}
+
+			return;
+		}
+
+		index.emplace(filename, files.size());
+
+		auto& pf = files.emplace_back(filename);
+
+		pf.object_id = object_id;
+		pf.perms = true;
+	}
+
+	vector<pending_file> files;
+
+private:
+	unordered_map<string, size_t> index;
+};
+
+// When pushing is debounced, we note in the .git directory when the first and last unpushed
+// commits were made, so that later runs know whether a push is due.
+struct push_state {
+	int64_t first;
+	int64_t last;
+};
+
+static int64_t time_now() {
+	return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static filesystem::path push_state_file(const GitRepo& repo) {
+	return filesystem::path{git_repository_path(repo.repo.get())} / "gitsql-push";
+}
+
+static optional<push_state> read_push_state(const GitRepo& repo) {
+	ifstream f(push_state_file(repo));
+	push_state ps;
+
+	if (!f.good())
+		return nullopt;
+
+	if (!(f >> ps.first >> ps.last))
+		return nullopt;
+
+	return ps;
+}
+
+static void write_push_state(const GitRepo& repo, const push_state& ps) {
+	ofstream f(push_state_file(repo), ios::trunc);
+
+	f << ps.first << " " << ps.last << "\n";
+
+	if (!f.good())
+		throw runtime_error("Error writing " + push_state_file(repo).string() + ".");
+}
+
+static void clear_push_state(const GitRepo& repo) {
+	error_code ec;
+
+	filesystem::remove(push_state_file(repo), ec);
+}
+
+static bool push_due(const push_state& ps, int64_t debounce, int64_t max_latency) {
+	auto now = time_now();
+
+	if (debounce <= 0 || now - ps.last >= debounce)
+		return true;
+
+	return max_latency > 0 && now - ps.first >= max_latency;
+}
+
+static void set_server_timeouts() {
+	// give up on remotes which don't respond, rather than waiting forever (milliseconds)
+	git_libgit2_opts(GIT_OPT_SET_SERVER_CONNECT_TIMEOUT, 30000);
+	git_libgit2_opts(GIT_OPT_SET_SERVER_TIMEOUT, 60000);
+}
+
+static void push_repo(const string& dir, const string& branch, unsigned int timeout) {
+	GitRepo repo(dir);
+
+	repo.try_push("refs/heads/" + (branch.empty() ? "master" : branch), timeout);
+
+	clear_push_state(repo);
+}
+
+static const unsigned int max_parallel_pushes = 4;
+static const unsigned int default_push_timeout = 300; // seconds
+
+// Runs pushes on a limited number of threads, so that a slow remote doesn't hold up the others.
+class push_pool {
+public:
+	~push_pool() {
+		wait();
+	}
+
+	void add(string_view dir, string_view branch, unsigned int timeout) {
+		{
+			lock_guard lg(lock);
+
+			jobs.emplace_back(dir, branch, timeout);
+
+			if (threads.size() < max_parallel_pushes && threads.size() < jobs.size() + busy) {
+				threads.emplace_back([](stop_token, push_pool* pp) {
+					pp->run();
+				}, this);
+			}
+		}
+
+		cv.notify_one();
+	}
+
+	// returns the number of pushes which failed
+	unsigned int wait() {
+		{
+			lock_guard lg(lock);
+
+			done = true;
+		}
+
+		cv.notify_all();
+
+		for (auto& t : threads) {
+			if (t.joinable())
+				t.join();
+		}
+
+		return failures;
+	}
+
+private:
+	struct push_job {
+		push_job(string_view dir, string_view branch, unsigned int timeout) :
+			dir(dir), branch(branch), timeout(timeout) { }
+
+		string dir;
+		string branch;
+		unsigned int timeout;
+	};
+
+	void run() noexcept {
+		do {
+			optional<push_job> job;
+
+			{
+				unique_lock ul(lock);
+
+				cv.wait(ul, [&]{ return !jobs.empty() || done; });
+
+				if (jobs.empty())
+					break;
+
+				job.emplace(move(jobs.front()));
+				jobs.pop_front();
+				busy++;
+			}
+
+			string err;
+
+			try {
+				push_repo(job->dir, job->branch, job->timeout);
+			} catch (const exception& e) {
+				err = e.what();
+			}
+
+			lock_guard lg(lock);
+
+			busy--;
+
+			if (!err.empty()) {
+				cerr << "Error pushing " << job->dir << ": " << err << endl;
+				failures++;
+			}
+		} while (true);
+	}
+
+	mutex lock;
+	condition_variable_any cv;
+	list<push_job> jobs;
+	vector<jthread> threads;
+	size_t busy = 0;
+	bool done = false;
+	unsigned int failures = 0;
+};
+
+// The LSN of the last commit on the primary, or the end of its log if it's not in an
+// availability group. dm_db_log_stats gives this in hex (VLF:block:slot), which we
+// convert into the numeric form used by msdb and the HADR DMVs.
+static optional<string> primary_log_position(tds::tds& tds, string_view db) {
+	tds::query sq(tds, R"(SELECT CONVERT(VARCHAR(25), COALESCE(
+	(SELECT last_commit_lsn FROM sys.dm_hadr_database_replica_states WHERE database_id = DB_ID(?) AND is_local = 1),
+	(SELECT CONVERT(DECIMAL(25,0), CONVERT(BIGINT, CONVERT(VARBINARY(4), SUBSTRING(log_end_lsn, 1, 8), 2))) * 1000000000000000 +
+		CONVERT(DECIMAL(25,0), CONVERT(BIGINT, CONVERT(VARBINARY(4), SUBSTRING(log_end_lsn, 10, 8), 2))) * 100000 +
+		CONVERT(BIGINT, CONVERT(VARBINARY(2), SUBSTRING(log_end_lsn, 19, 4), 2))
+	FROM sys.dm_db_log_stats(DB_ID(?)))
+)))", db, db);
+
+	if (!sq.fetch_row() || sq[0].is_null)
+		return nullopt;
+
+	return (string)sq[0];
+}
+
+// For a readable secondary, the LSN of the last commit it has redone. For a log shipping
+// standby, the LSN up to which the last log backup it restored goes.
+static optional<string> replica_log_position(tds::tds& tds, string_view db) {
+	tds::query sq(tds, R"(SELECT CONVERT(VARCHAR(25), COALESCE(
+	(SELECT last_commit_lsn FROM sys.dm_hadr_database_replica_states WHERE database_id = DB_ID(?) AND is_local = 1 AND is_primary_replica = 0),
+	(SELECT TOP 1 backupset.last_lsn
+	FROM msdb.dbo.restorehistory
+	JOIN msdb.dbo.backupset ON backupset.backup_set_id = restorehistory.backup_set_id
+	WHERE restorehistory.destination_database_name = ? AND DATABASEPROPERTYEX(?, 'IsInStandBy') = 1
+	ORDER BY restorehistory.restore_history_id DESC)
+)))", db, db, db);
+
+	if (!sq.fetch_row() || sq[0].is_null)
+		return nullopt;
+
+	return (string)sq[0];
+}
+
+static bool lsn_less(string_view a, string_view b) {
+	if (a.size() != b.size())
+		return a.size() < b.size();
+
+	return a < b;
+}
+
+// Notes in git_repo.synced_lsn that the repo has everything in it up to pos in the log, so
+// that a dump from a replica knows how far the replica needs to have got.
+static void record_synced_lsn(tds::tds& tds, unsigned int repo_id, const string& pos) {
+	tds.run("UPDATE master.dbo.git_repo SET synced_lsn = CONVERT(DECIMAL(25,0), ?) WHERE id = ? AND (synced_lsn IS NULL OR synced_lsn < CONVERT(DECIMAL(25,0), ?))",
+			pos, repo_id, pos);
+}
+
+// Records the primary's current log position as synced_lsn. This is only used to decide
+// whether a replica has caught up, so isn't worth failing over.
+static void record_primary_position(tds::tds& tds, tds::tds& primary, unsigned int repo_id, string_view db) {
+	try {
+		if (auto pos = primary_log_position(primary, db); pos.has_value())
+			record_synced_lsn(tds, repo_id, pos.value());
+	} catch (const exception& e) {
+		cerr << format("Could not record log position of {}: {}", db, e.what()) << endl;
+	}
+}
+
+// Consecutive events by the same author within window seconds of the first (and from the same
+// session, if by_spid is set) are put in the same commit, up to max_events of them. A window
+// of 0 turns this off.
+struct squash_policy {
+	int64_t window;
+	bool by_spid;
+	int64_t max_events;
+};
+
+static const int64_t default_squash_max_events = 500;
+
+// Commits built up in memory before the branch is moved and the queue rows deleted.
+static const unsigned int max_chained_commits = 1000;
+
+struct flush_group {
+	flush_group(GitRepo& repo) : gu(repo) { }
+
+	unsigned int first_id;
+	unsigned int last_id; // last of the consecutive events, not counting the rest of their transactions
+	map<int64_t, unsigned int> trans; // tran_id to the last of its rows
+	tds::datetimeoffset dto;
+	string name, email, description;
+	bool clear_all = false;
+	list<unsigned int> delete_commits;
+	vector<pair<string, string>> perms_splices; // filename and new GRANT section
+	git_update gu;
+};
+
+// Whether filename is where the object schema.name lives. The trigger builds filenames
+// from the raw names and dump from sanitized ones, so accept either.
+static bool object_in_file(string_view filename, string_view schema, string_view name) {
+	auto in_schema = [&](string_view s) {
+		return filename.starts_with(s) && filename.size() > s.size() && filename[s.size()] == '/';
+	};
+
+	auto named = [&](string_view n) {
+		return filename.ends_with(".sql") && filename.substr(0, filename.size() - 4).ends_with(n) &&
+			filename.size() > n.size() + 4 && filename[filename.size() - n.size() - 5] == '/';
+	};
+
+	return (in_schema(schema) || in_schema(sanitize_fn(schema))) && (named(name) || named(sanitize_fn(name)));
+}
+
+static unique_ptr<flush_group> read_flush_group(tds::tds& tds, GitRepo& repo, unsigned int repo_id, const string& db,
+												const squash_policy& squash, unsigned int after_id,
+												const map<int64_t, unsigned int>& skip_trans) {
+	auto g = make_unique<flush_group>(repo);
+	pending_files pending;
+	vector<string> descriptions;
+	bool merged_trans = false;
+
+	{
+		auto skip = json::array();
+
+		for (const auto& t : skip_trans) {
+			skip.push_back(t.first);
+		}
+
+		// The first event after the previous group, then any consecutive events which the squash
+		// policy lets us merge with it, then the rest of all their transactions. Everything up to
+		// the last consecutive event is in this group, so the next one starts after that. Rows
+		// of transactions already flushed are still in the queue until the branch is moved, so
+		// skip over them.
+
+		tds::trans trans(tds);
+		tds::query sq(tds, R"(WITH skip AS (
+	SELECT CONVERT(BIGINT, value) AS tran_id FROM OPENJSON(?)
+), first AS (
+	SELECT TOP 1 id, tran_id, username, spid, dto
+	FROM master.dbo.git
+	WHERE repo = ? AND id > ? AND (tran_id IS NULL OR tran_id NOT IN (SELECT tran_id FROM skip))
+	ORDER BY id
+), run AS (
+	SELECT id, tran_id FROM first
+	UNION ALL
+	SELECT squashed.id, squashed.tran_id
+	FROM first
+	CROSS APPLY (
+		SELECT TOP (?) git.id, git.tran_id
+		FROM master.dbo.git
+		WHERE git.repo = ? AND git.id > first.id AND (git.tran_id IS NULL OR git.tran_id NOT IN (SELECT tran_id FROM skip)) AND git.id < ISNULL((
+			SELECT MIN(brk.id)
+			FROM master.dbo.git brk
+			WHERE brk.repo = ? AND brk.id > first.id AND (brk.tran_id IS NULL OR brk.tran_id NOT IN (SELECT tran_id FROM skip)) AND NOT (
+				brk.username = first.username AND
+				brk.dto <= DATEADD(SECOND, ?, first.dto) AND
+				(? = 0 OR ISNULL(brk.spid, -1) = ISNULL(first.spid, -1))
+			)
+		), 2147483647)
+		ORDER BY git.id
+	) squashed
+), ids AS (
+	SELECT id, 1 AS in_run FROM run
+	UNION ALL
+	SELECT git.id, 0 FROM master.dbo.git WHERE git.repo = ? AND git.tran_id IN (SELECT tran_id FROM run)
+)
+SELECT
+	git.id,
+	git.username,
+	git.description,
+	git.dto,
+	ISNULL(git.tran_id, -1),
+	git_files.filename,
+	git_files.data,
+	git_files.object_id,
+	git_files.compressed,
+	git_files.perms,
+	ids.in_run
+FROM (
+	SELECT id, MAX(in_run) AS in_run
+	FROM ids
+	GROUP BY id
+) ids
+JOIN master.dbo.git ON git.id = ids.id
+JOIN master.dbo.git_files ON git_files.id = git.id
+ORDER BY git.id
+)", skip.dump(), repo_id, after_id, squash.window > 0 ? max(squash.max_events - 1, (int64_t)0) : 0,
+	repo_id, repo_id, squash.window, squash.by_spid ? 1 : 0, repo_id);
+
+		if (!sq.fetch_row())
+			return nullptr;
+
+		g->first_id = g->last_id = (unsigned int)sq[0];
+		g->description = (string)sq[2];
+		g->dto = (tds::datetimeoffset)sq[3];
+
+		get_user_details((u16string)sq[1], g->name, g->email);
+
+		g->delete_commits.push_back(g->first_id);
+		descriptions.emplace_back(g->description);
+
+		do {
+			auto tran_id = (int64_t)sq[4];
+
+			if (tran_id != -1)
+				g->trans[tran_id] = (unsigned int)sq[0];
+
+			if ((unsigned int)sq[0] != g->first_id) {
+				auto new_commit = (unsigned int)sq[0];
+
+				// rows are ordered by id, so any repeat will be of the last one we saw
+				if (g->delete_commits.back() != new_commit) {
+					g->delete_commits.push_back(new_commit);
+					descriptions.emplace_back((string)sq[2]);
+
+					if ((int)sq[10] != 0)
+						g->last_id = new_commit;
+					else
+						merged_trans = true;
+				}
+			}
+
+			if (sq[5].is_null)
+				g->clear_all = true;
+			else if ((int)sq[9] != 0)
+				pending.set_perms((string)sq[5], (int64_t)sq[7]);
+			else {
+				auto& pf = pending.set((string)sq[5]);
+
+				if (!sq[6].is_null) {
+					if ((int)sq[8] != 0)
+						pf.data = gunzip(sq[6].val);
+					else
+						pf.data = move(sq[6].val);
+				}
+				else if (!sq[7].is_null)
+					pf.object_id = (int64_t)sq[7];
+			}
+		} while (sq.fetch_row());
+	}
+
+	if (g->last_id != g->first_id) {
+		// squashed - list everything in the commit message
+		auto desc = format("{} (and {} more)\n\n", g->description, descriptions.size() - 1);
+
+		for (const auto& d : descriptions) {
+			desc += d + "\n";
+		}
+
+		g->description = move(desc);
+	} else if (merged_trans)
+		g->description += " (transaction)";
+
+	// only create blobs for the final version of each file - the git_update thread
+	// compresses these while we fetch the DDL for any deferred objects
+
+	vector<int64_t> deferred, perms_changed;
+
+	g->gu.start();
+
+	for (auto& pf : pending.files) {
+		if (pf.perms)
+			perms_changed.push_back(pf.object_id.value());
+		else if (pf.data.has_value()) {
+			visit([&](auto&& d) {
+				g->gu.add_file(pf.filename, move(d));
+			}, move(pf.data.value()));
+		} else if (pf.object_id.has_value())
+			deferred.push_back(pf.object_id.value());
+		else
+			g->gu.remove_file(pf.filename);
+	}
+
+	if (!deferred.empty() || !perms_changed.empty())
+		tds.run(tds::no_check{"USE " + brackets_escape(db)});
+
+	if (!deferred.empty()) {
+		// The DDL is that of the object as it is now, not as it was when the event was queued -
+		// so an earlier commit may get a later version of the object. An object which has since
+		// been dropped, or renamed so that it no longer lives in this file, is skipped: the DROP
+		// or RENAME event later in the queue will remove the file and write the new one.
+
+		unordered_map<int64_t, pair<string, string>> names;
+
+		{
+			auto ids = json::array();
+
+			for (auto id : deferred) {
+				ids.push_back(id);
+			}
+
+			tds::query sq(tds, R"(SELECT objects.object_id, SCHEMA_NAME(objects.schema_id), objects.name
+FROM OPENJSON(?) ids
+JOIN sys.objects ON objects.object_id = CONVERT(INT, ids.value))", ids.dump());
+
+			while (sq.fetch_row()) {
+				names.emplace((int64_t)sq[0], make_pair((string)sq[1], (string)sq[2]));
+			}
+		}
+
+		auto ddls = objects_ddl(tds, deferred, false);
+
+		for (const auto& pf : pending.files) {
+			if (!pf.object_id.has_value() || pf.perms)
+				continue;
+
+			auto n = names.find(pf.object_id.value());
+
+			if (n == names.end() || !object_in_file(pf.filename, n->second.first, n->second.second))
+				continue;
+
+			if (auto f = ddls.find(pf.object_id.value()); f != ddls.end())
+				g->gu.add_file(pf.filename, move(f->second));
+		}
+	}
+
+	if (!perms_changed.empty()) {
+		auto grants = objects_grants(tds, perms_changed);
+
+		for (auto& pf : pending.files) {
+			if (!pf.perms)
+				continue;
+
+			auto f = grants.find(pf.object_id.value());
+
+			if (f == grants.end()) // dropped since
+				continue;
+
+			if (pf.data.has_value()) {
+				auto ddl = visit([](const auto& d) {
+					return string{d.begin(), d.end()};
+				}, pf.data.value());
+
+				g->gu.add_file(pf.filename, splice_perms(ddl, f->second));
+			} else {
+				// spliced onto the committed file, once the previous group is in
+				g->perms_splices.emplace_back(pf.filename, move(f->second));
+			}
+		}
+	}
+
+	return g;
+}
+
+static void commit_flush_group(commit_chain& chain, flush_group& g) {
+	if (!g.perms_splices.empty()) {
+		if (auto tree = chain.tree()) {
+			// files which aren't there yet will get their permissions when they're created
+			for (const auto& ps : g.perms_splices) {
+				if (!tree->entry_bypath(ps.first))
+					continue;
+
+				g.gu.add_file(ps.first, splice_perms((string)GitBlob(*tree, ps.first), ps.second));
+			}
+		}
+	}
+
+	g.gu.stop();
+
+	if (!g.gu.files2.empty() || g.clear_all)
+		chain.add(g.name, g.email, g.description, g.gu.files2, g.clear_all, g.dto);
+}
+
+static void delete_flushed(tds::tds& tds, const vector<unsigned int>& ids) {
+	if (ids.empty())
+		return;
+
+	auto j = json::array();
 
-						bool found = false;
-						auto new_commit = (unsigned int)sq[0];
+	for (auto id : ids) {
+		j.push_back(id);
+	}
 
-						for (auto dc : delete_commits) {
-							if (dc == new_commit) {
-								found = true;
-								break;
-							}
-						}
+	auto s = j.dump();
 
-						if (!found)
-							delete_commits.push_back(new_commit);
-					}
+	tds::trans trans(tds);
 
-					if (sq[5].is_null)
-						clear_all = true;
-					else {
-						if (merged_trans) {
-							auto fn = (string)sq[5];
-
-							for (auto it = files.begin(); it != files.end(); it++) {
-								if (it->filename == fn) {
-									files.erase(it);
-									break;
-								}
-							}
-						}
+	tds.run("DELETE FROM master.dbo.git_files WHERE id IN (SELECT CONVERT(INT, value) FROM OPENJSON(?))", s);
+	tds.run("DELETE FROM master.dbo.git WHERE id IN (SELECT CONVERT(INT, value) FROM OPENJSON(?))", s);
 
-						if (!sq[6].is_null)
-							files.emplace_back((string)sq[5], repo.blob_create_from_buffer((string)sq[6]));
-						else
-							files.emplace_back((string)sq[5], nullopt);
-					}
+	trans.commit();
+}
 
-					if (!sq.fetch_row())
-						break;
-				} while (true);
+static void flush_git(const string& db_server) {
+	struct repo {
+		repo(unsigned int id, string_view dir, string_view branch, string_view db, int64_t push_debounce,
+			 int64_t push_max_latency, unsigned int push_timeout, const squash_policy& squash) :
+			id(id), dir(dir), branch(branch), db(db), push_debounce(push_debounce),
+			push_max_latency(push_max_latency), push_timeout(push_timeout), squash(squash) { }
+
+		unsigned int id;
+		string dir;
+		string branch;
+		string db;
+		int64_t push_debounce;
+		int64_t push_max_latency;
+		unsigned int push_timeout;
+		squash_policy squash;
+	};
+
+	vector<repo> repos;
+	push_pool pushes;
+
+	git_libgit2_init();
+	git_libgit2_opts(GIT_OPT_ENABLE_STRICT_OBJECT_CREATION, false);
+	git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, 0);
+	set_server_timeouts();
+
+	{
+		tds::tds tds(db_server, db_username, db_password, db_app);
+		tds.run("SET LOCK_TIMEOUT 0; SET XACT_ABORT ON; DELETE FROM master.dbo.git WHERE NOT EXISTS (SELECT * FROM master.dbo.git_files WHERE git_files.id = git.id)");
+
+		{
+			// repos with debounced pushing may have a push due even if nothing's queued
+			tds::batch sq(tds, R"(SELECT id, dir, branch, db, ISNULL(push_debounce, 0), ISNULL(push_max_latency, 0), push_timeout,
+	ISNULL(squash_window, 0), ISNULL(squash_spid, 0), squash_max
+FROM master.dbo.git_repo
+WHERE EXISTS (SELECT * FROM master.dbo.git WHERE git.repo = git_repo.id) OR push_debounce > 0)");
+
+			while (sq.fetch_row()) {
+				squash_policy squash{(int64_t)sq[7], (int)sq[8] != 0, sq[9].is_null ? default_squash_max_events : (int64_t)sq[9]};
+
+				repos.emplace_back((unsigned int)sq[0], (string)sq[1], (string)sq[2], (string)sq[3], (int64_t)sq[4], (int64_t)sq[5],
+								   sq[6].is_null ? default_push_timeout : (unsigned int)sq[6], squash);
+			}
+
+			if (repos.size() == 0)
+				return;
+		}
+
+#ifndef _WIN32
+		// look up all the authors in one go, while we're getting on with the first commits
+		try {
+			vector<string> usernames;
+
+			{
+				tds::query sq(tds, "SELECT DISTINCT username FROM master.dbo.git");
+
+				while (sq.fetch_row()) {
+					usernames.emplace_back((string)sq[0]);
+				}
+			}
+
+			prefetch_ldap_details(usernames);
+		} catch (const exception& e) {
+			cerr << e.what() << endl;
+		}
+#endif
+	}
+
+	for (const auto& r : repos) {
+		GitRepo repo(r.dir);
+		unique_ptr<flush_group> prev;
+
+		tds::tds tds(db_server, db_username, db_password, db_app);
+
+		tds.run("SET LOCK_TIMEOUT 0; SET XACT_ABORT ON;");
+
+		// While the git_update thread is compressing one group, we fetch the next. Commits are
+		// chained in memory, and the branch only moved every so often - the queue rows are kept
+		// until then, so that nothing is lost if we fall over before that.
+
+		bool committed = false;
+		auto old_commit = branch_commit(repo, r.branch);
+		commit_chain chain(repo, r.branch);
+		unsigned int after_id = 0;
+		map<int64_t, unsigned int> open_trans;
+		vector<unsigned int> done;
+
+		auto finish = [&]() {
+			if (chain.finish()) {
+				committed = true;
+
+				// everything we've committed was read before this point in the log
+				record_primary_position(tds, tds, r.id, r.db);
 			}
 
-			if (!files.empty() || clear_all)
-				update_git(repo, name, email, description, files, clear_all, dto, r.branch);
+			delete_flushed(tds, done);
+			done.clear();
+		};
+
+		try {
+			while (true) {
+				auto g = read_flush_group(tds, repo, r.id, r.db, r.squash, after_id, open_trans);
+
+				if (prev) {
+					commit_flush_group(chain, *prev);
+					done.insert(done.end(), prev->delete_commits.begin(), prev->delete_commits.end());
+					prev.reset();
+
+					if (chain.pending() >= max_chained_commits)
+						finish();
+				}
+
+				if (!g)
+					break;
+
+				after_id = g->last_id;
 
-			if (!delete_commits.empty()) {
-				tds::trans trans(tds);
+				for (const auto& t : g->trans) {
+					auto& last = open_trans[t.first];
 
-				while (!delete_commits.empty()) {
-					tds.run("DELETE FROM master.dbo.git WHERE id=?", delete_commits.front());
-					tds.run("DELETE FROM master.dbo.git_files WHERE id=?", delete_commits.front());
-					delete_commits.pop_front();
+					last = max(last, t.second);
 				}
 
-				trans.commit();
+				// transactions whose rows are all behind us no longer need skipping
+				erase_if(open_trans, [&](const auto& t) {
+					return t.second <= after_id;
+				});
+
+				prev = move(g);
+			}
+		} catch (...) {
+			// keep the groups which did get committed, so that the next flush starts at the one which failed
+			try {
+				finish();
+			} catch (const exception& e) {
+				cerr << e.what() << endl;
 			}
+
+			throw;
 		}
 
-		if (!repo.is_bare() && repo.branch_is_head(r.branch.empty() ? "master" : r.branch)) {
-			git_checkout_options opts;
+		finish();
+
+		auto ps = read_push_state(repo);
 
-			if (git_checkout_options_init(&opts, GIT_CHECKOUT_OPTIONS_VERSION))
-				throw runtime_error("git_checkout_options_init failed");
+		if (committed) {
+			auto now = time_now();
 
-			opts.checkout_strategy = GIT_CHECKOUT_FORCE;
+			ps = push_state{ps.has_value() ? ps.value().first : now, now};
+			write_push_state(repo, ps.value());
+		}
 
+		if ((committed || checkout_failed(repo)) && !repo.is_bare() && repo.branch_is_head(r.branch.empty() ? "master" : r.branch)) {
 			try {
-				repo.checkout_head(&opts);
+				update_working_dir(repo, old_commit);
 			} catch (const exception& e) {
 				cerr << e.what() << endl;
 			}
 		}
 
-		try {
-			repo.try_push("refs/heads/" + (r.branch.empty() ? "master" : r.branch));
-		} catch (const exception& e) {
-			cerr << e.what() << endl;
+		// push in the background while we get on with the next repo
+		if (ps.has_value() && push_due(ps.value(), r.push_debounce, r.push_max_latency))
+			pushes.add(r.dir, r.branch, r.push_timeout);
+	}
+
+	pushes.wait();
+}
+
+// Pushes any repos which have commits that debouncing has held back, or just the one given.
+static void push_pending(const string& db_server, optional<unsigned int> repo_id) {
+	struct repo {
+		repo(string_view dir, string_view branch, unsigned int timeout) : dir(dir), branch(branch), timeout(timeout) { }
+
+		string dir;
+		string branch;
+		unsigned int timeout;
+	};
+
+	vector<repo> repos;
+	push_pool pushes;
+
+	git_libgit2_init();
+	git_libgit2_opts(GIT_OPT_SET_OWNER_VALIDATION, 0);
+	set_server_timeouts();
+
+	{
+		tds::tds tds(db_server, db_username, db_password, db_app);
+
+		if (repo_id.has_value()) {
+			tds::query sq(tds, "SELECT dir, branch, push_timeout FROM master.dbo.git_repo WHERE id = ?", repo_id.value());
+
+			while (sq.fetch_row()) {
+				repos.emplace_back((string)sq[0], (string)sq[1], sq[2].is_null ? default_push_timeout : (unsigned int)sq[2]);
+			}
+		} else {
+			tds::query sq(tds, "SELECT dir, branch, push_timeout FROM master.dbo.git_repo");
+
+			while (sq.fetch_row()) {
+				repos.emplace_back((string)sq[0], (string)sq[1], sq[2].is_null ? default_push_timeout : (unsigned int)sq[2]);
+			}
+		}
+	}
+
+	if (repo_id.has_value() && repos.empty())
+		throw formatted_error("Repo {} not found.", repo_id.value());
+
+	for (const auto& r : repos) {
+		if (!repo_id.has_value()) {
+			GitRepo repo(r.dir);
+
+			if (!read_push_state(repo).has_value())
+				continue;
 		}
+
+		cout << "Pushing " << r.dir << "." << endl;
+
+		pushes.add(r.dir, r.branch, r.timeout);
 	}
+
+	if (auto failures = pushes.wait(); failures != 0)
+		throw formatted_error("{} push{} failed.", failures, failures == 1 ? "" : "es");
 }
 
 class lockfile {
@@ -1770,107 +2873,303 @@ private:
 
 static string object_ddl2(tds::tds& tds, string_view type, string_view orig_ddl, int64_t id, u16string_view schema,
 						  u16string_view object, bool has_perms, bool nolock) {
-	string ddl;
+	auto ddl = object_ddl_body(tds, type, orig_ddl, id, schema, object, nolock);
 
-	if (type == "U") // table
-		ddl = table_ddl(tds, id, nolock);
-	else if (type == "V")
-		ddl = munge_definition(orig_ddl, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object), lex::VIEW);
-	else if (type == "P")
-		ddl = munge_definition(orig_ddl, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object), lex::PROCEDURE);
-	else if (type == "FN" || type == "TF" || type == "IF")
-		ddl = munge_definition(orig_ddl, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object), lex::FUNCTION);
+	if (has_perms)
+		ddl += object_perms(tds, id, brackets_escape(tds::utf16_to_utf8(schema)) + "." + brackets_escape(tds::utf16_to_utf8(object)));
 
-	ddl = fix_whitespace(ddl);
+	return ddl;
+}
 
-	if (!ddl.empty() && ddl.front() == '\n') {
-		auto pos = ddl.find_first_not_of("\n");
+static string object_ddl(tds::tds& tds, u16string_view schema, u16string_view object) {
+	int64_t id;
+	string type, ddl;
+	bool has_perms;
 
-		if (pos == string::npos)
-			ddl.clear();
+	if (!object.empty() && object.front() == u'#') {
+		tds::query sq(tds, "SELECT OBJECT_ID(?)", u"tempdb.dbo." + u16string(object));
+
+		if (!sq.fetch_row() || sq[0].is_null)
+			throw formatted_error("Could not find ID for temporary table {}.", tds::utf16_to_utf8(object));
+
+		id = (int64_t)sq[0];
+		type = "U";
+		has_perms = false;
+		ddl = "";
+	} else {
+		tds::query sq(tds, R"(SELECT objects.object_id,
+	RTRIM(objects.type),
+	CASE WHEN EXISTS (SELECT * FROM sys.database_permissions WHERE class_desc = 'OBJECT_OR_COLUMN' AND major_id = objects.object_id) THEN 1 ELSE 0 END,
+	sql_modules.definition
+FROM sys.objects
+LEFT JOIN sys.sql_modules ON sql_modules.object_id = objects.object_id
+WHERE objects.name = ? AND objects.schema_id = SCHEMA_ID(?))", object, schema);
+
+		if (!sq.fetch_row())
+			throw formatted_error("Could not find ID for object {}.{}.", tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object));
+
+		id = (int64_t)sq[0];
+		type = (string)sq[1];
+		has_perms = (unsigned int)sq[2] != 0;
+		ddl = (string)sq[3];
+	}
+
+	return object_ddl2(tds, type, ddl, id, schema, object, has_perms, false);
+}
+
+static string object_ddl_id(tds::tds& tds, int64_t id) {
+	string type, ddl;
+	u16string schema, name;
+	bool has_perms;
+
+	{
+		tds::query sq(tds, R"(SELECT objects.name,
+	RTRIM(objects.type),
+	CASE WHEN EXISTS (SELECT * FROM sys.database_permissions WITH (NOLOCK) WHERE class_desc = 'OBJECT_OR_COLUMN' AND major_id = objects.object_id) THEN 1 ELSE 0 END,
+	sql_modules.definition,
+	SCHEMA_NAME(objects.schema_id)
+FROM sys.objects WITH (NOLOCK)
+LEFT JOIN sys.sql_modules WITH (NOLOCK) ON sql_modules.object_id = objects.object_id
+WHERE objects.object_id = ?)", id);
+
+		if (!sq.fetch_row())
+			throw formatted_error("Could not find ID object ID {}.", id);
+
+		name = (u16string)sq[0];
+		type = (string)sq[1];
+		has_perms = (unsigned int)sq[2] != 0;
+		ddl = (string)sq[3];
+		schema = (u16string)sq[4];
+	}
+
+	return object_ddl2(tds, type, ddl, id, schema, name, has_perms, true);
+}
+
+static bool show_objects(tds::tds& tds, const vector<u16string>& objects, bool json_output) {
+	struct show_obj {
+		show_obj(u16string_view name) : name(name) { }
+
+		u16string name;
+		u16string lookup;
+		optional<int64_t> id;
+		optional<string> ddl;
+		string error;
+	};
+
+	vector<show_obj> objs;
+	map<u16string, vector<size_t>> dbs;
+	bool success = true;
+
+	objs.reserve(objects.size());
+
+	for (const auto& o : objects) {
+		auto& obj = objs.emplace_back(o);
+		auto onp = tds::parse_object_name(o);
+		u16string db{onp.db};
+
+		if (!onp.server.empty()) {
+			obj.error = "Cannot show definition of objects on remote servers.";
+			continue;
+		}
+
+		if (!onp.name.empty() && onp.name.front() == u'#') {
+			db = u"tempdb";
+			obj.lookup = u"tempdb.dbo." + u16string(onp.name);
+		} else if (!onp.schema.empty())
+			obj.lookup = brackets_escape(onp.schema) + u"." + brackets_escape(onp.name);
 		else
-			ddl = ddl.substr(pos);
+			obj.lookup = brackets_escape(onp.name);
+
+		dbs[db].push_back(objs.size() - 1);
 	}
 
-	while (!ddl.empty() && (ddl.back() == '\n' || ddl.back() == ' ')) {
-		ddl.pop_back();
+	auto orig_db = tds.db_name();
+
+	for (const auto& d : dbs) {
+		const auto& db = d.first.empty() ? orig_db : d.first;
+		auto names = json::array();
+		vector<int64_t> ids;
+
+		tds.run(tds::no_check{u"USE " + brackets_escape(db)});
+
+		for (auto i : d.second) {
+			names.push_back(tds::utf16_to_utf8(objs[i].lookup));
+		}
+
+		{
+			tds::query sq(tds, "SELECT CONVERT(INT, ids.[key]), OBJECT_ID(ids.value) FROM OPENJSON(?) ids", names.dump());
+
+			while (sq.fetch_row()) {
+				auto& obj = objs[d.second[(size_t)(int64_t)sq[0]]];
+
+				if (sq[1].is_null)
+					obj.error = format("Could not find ID for object {}.", tds::utf16_to_utf8(obj.name));
+				else {
+					obj.id = (int64_t)sq[1];
+					ids.push_back(obj.id.value());
+				}
+			}
+		}
+
+		// the same object might have been given more than once, possibly under different names
+		ranges::sort(ids);
+		ids.erase(unique(ids.begin(), ids.end()), ids.end());
+
+		auto ddls = objects_ddl(tds, ids, false);
+
+		for (auto i : d.second) {
+			auto& obj = objs[i];
+
+			if (!obj.id.has_value())
+				continue;
+
+			if (auto f = ddls.find(obj.id.value()); f != ddls.end())
+				obj.ddl = f->second;
+			else
+				obj.error = format("Could not find object ID {}.", obj.id.value());
+		}
 	}
 
-	ddl += "\n";
+	if (json_output) {
+		auto j = json::array();
 
-	if (has_perms)
-		ddl += object_perms(tds, id, brackets_escape(tds::utf16_to_utf8(schema)) + "." + brackets_escape(tds::utf16_to_utf8(object)));
+		for (const auto& obj : objs) {
+			auto o = json::object();
+
+			o["object"] = tds::utf16_to_utf8(obj.name);
+
+			if (obj.ddl.has_value())
+				o["ddl"] = obj.ddl.value();
+			else {
+				o["error"] = obj.error;
+				success = false;
+			}
+
+			j.push_back(o);
+		}
+
+		cout << j.dump(3) << endl;
+
+		return success;
+	}
+
+	for (const auto& obj : objs) {
+		if (!obj.ddl.has_value()) {
+			cerr << obj.error << endl;
+			success = false;
+			continue;
+		}
+
+		if (objs.size() == 1)
+			cout << obj.ddl.value();
+		else
+			cout << "-- " << tds::utf16_to_utf8(obj.name) << "\n" << obj.ddl.value() << "\n";
+	}
+
+	return success;
+}
+
+static void read_object_list(istream& in, vector<u16string>& objects) {
+	string line;
+
+	while (getline(in, line)) {
+		while (!line.empty() && (line.back() == '\r' || line.back() == ' ' || line.back() == '\t')) {
+			line.pop_back();
+		}
+
+		if (line.empty())
+			continue;
+
+		objects.emplace_back(tds::utf8_to_utf16(line));
+	}
+}
+
+// Generates the DDL for something which do_dump_sql writes but which isn't in
+// sys.objects, so that the trigger can capture it when it changes. Returns
+// nullopt if it no longer exists, in which case its file gets removed.
+static optional<string> securable_ddl(tds::tds& tds, string_view kind, string_view schema, string_view name) {
+	string ddl;
+
+	if (kind == "type") {
+		int32_t system_type_id;
+		int16_t max_length;
+		uint8_t precision, scale;
+		bool is_nullable;
+		optional<int64_t> table_id;
+
+		{
+			tds::query sq(tds, R"(SELECT types.system_type_id,
+	types.max_length,
+	types.precision,
+	types.scale,
+	types.is_nullable,
+	table_types.type_table_object_id
+FROM sys.types
+LEFT JOIN sys.table_types ON table_types.user_type_id = types.user_type_id
+WHERE types.name = ? AND types.schema_id = SCHEMA_ID(?) AND types.is_user_defined = 1)", name, schema);
+
+			if (!sq.fetch_row())
+				return nullopt;
 
-	return ddl;
-}
+			system_type_id = (int32_t)sq[0];
+			max_length = (int16_t)sq[1];
+			precision = (uint8_t)sq[2];
+			scale = (uint8_t)sq[3];
+			is_nullable = (unsigned int)sq[4] != 0;
 
-static string object_ddl(tds::tds& tds, u16string_view schema, u16string_view object) {
-	int64_t id;
-	string type, ddl;
-	bool has_perms;
+			if (!sq[5].is_null)
+				table_id = (int64_t)sq[5];
+		}
 
-	if (!object.empty() && object.front() == u'#') {
-		tds::query sq(tds, "SELECT OBJECT_ID(?)", u"tempdb.dbo." + u16string(object));
+		if (table_id.has_value())
+			ddl = table_ddl(tds, table_id.value(), false);
+		else
+			ddl = get_type_definition(name, schema, system_type_id, max_length, precision, scale, is_nullable);
+	} else if (kind == "schema") {
+		{
+			tds::query sq(tds, "SELECT SCHEMA_ID(?)", name);
 
-		if (!sq.fetch_row() || sq[0].is_null)
-			throw formatted_error("Could not find ID for temporary table {}.", tds::utf16_to_utf8(object));
+			if (!sq.fetch_row() || sq[0].is_null)
+				return nullopt;
+		}
 
-		id = (int64_t)sq[0];
-		type = "U";
-		has_perms = false;
-		ddl = "";
-	} else {
-		tds::query sq(tds, R"(SELECT objects.object_id,
-	RTRIM(objects.type),
-	CASE WHEN EXISTS (SELECT * FROM sys.database_permissions WHERE class_desc = 'OBJECT_OR_COLUMN' AND major_id = objects.object_id) THEN 1 ELSE 0 END,
-	sql_modules.definition
-FROM sys.objects
-LEFT JOIN sys.sql_modules ON sql_modules.object_id = objects.object_id
-WHERE objects.name = ? AND objects.schema_id = SCHEMA_ID(?))", object, schema);
+		ddl = get_schema_definition(tds, name);
+	} else if (kind == "role") {
+		int64_t id;
 
-		if (!sq.fetch_row())
-			throw formatted_error("Could not find ID for object {}.{}.", tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object));
+		{
+			tds::query sq(tds, "SELECT principal_id FROM sys.database_principals WHERE name = ? AND type = 'R'", name);
 
-		id = (int64_t)sq[0];
-		type = (string)sq[1];
-		has_perms = (unsigned int)sq[2] != 0;
-		ddl = (string)sq[3];
-	}
+			if (!sq.fetch_row())
+				return nullopt;
 
-	return object_ddl2(tds, type, ddl, id, schema, object, has_perms, false);
-}
+			id = (int64_t)sq[0];
+		}
 
-static string object_ddl_id(tds::tds& tds, int64_t id) {
-	string type, ddl;
-	u16string schema, name;
-	bool has_perms;
+		ddl = get_role_definition(tds, name, id);
+	} else if (kind == "partition_function" || kind == "partition_scheme") {
+		auto v = kind == "partition_function" ? partition_functions_ddl(tds, string{name}) : partition_schemes_ddl(tds, string{name});
 
-	{
-		tds::query sq(tds, R"(SELECT objects.name,
-	RTRIM(objects.type),
-	CASE WHEN EXISTS (SELECT * FROM sys.database_permissions WITH (NOLOCK) WHERE class_desc = 'OBJECT_OR_COLUMN' AND major_id = objects.object_id) THEN 1 ELSE 0 END,
-	sql_modules.definition,
-	SCHEMA_NAME(objects.schema_id)
-FROM sys.objects WITH (NOLOCK)
-LEFT JOIN sys.sql_modules WITH (NOLOCK) ON sql_modules.object_id = objects.object_id
-WHERE objects.object_id = ?)", id);
+		if (v.empty())
+			return nullopt;
+
+		return move(v.front().second);
+	} else if (kind == "db_trigger") {
+		tds::query sq(tds, "SELECT sql_modules.definition FROM sys.triggers JOIN sys.sql_modules ON sql_modules.object_id = triggers.object_id WHERE triggers.parent_class_desc = 'DATABASE' AND triggers.name = ?", name);
 
 		if (!sq.fetch_row())
-			throw formatted_error("Could not find ID object ID {}.", id);
+			return nullopt;
 
-		name = (u16string)sq[0];
-		type = (string)sq[1];
-		has_perms = (unsigned int)sq[2] != 0;
-		ddl = (string)sq[3];
-		schema = (u16string)sq[4];
-	}
+		ddl = (string)sq[0];
+	} else
+		throw formatted_error("Unrecognized object kind \"{}\".", kind);
 
-	return object_ddl2(tds, type, ddl, id, schema, name, has_perms, true);
+	return tidy_ddl(ddl);
 }
 
 static void write_object_ddl(tds::tds& tds, u16string_view schema, u16string_view object,
 							 const optional<u16string>& bind_token, unsigned int commit_id,
-							 u16string_view filename, u16string_view db) {
+							 u16string_view filename, u16string_view db, string_view kind, optional<bool> compress) {
 	u16string old_db;
 
 	if (bind_token.has_value()) {
@@ -1886,19 +3185,124 @@ static void write_object_ddl(tds::tds& tds, u16string_view schema, u16string_vie
 			tds.run(tds::no_check{u"USE " + brackets_escape(db)});
 	}
 
-	auto ddl = object_ddl(tds, schema, object);
+	optional<string> ddl;
+
+	if (kind == "object")
+		ddl = object_ddl(tds, schema, object);
+	else
+		ddl = securable_ddl(tds, kind, tds::utf16_to_utf8(schema), tds::utf16_to_utf8(object));
 
 	if (!db.empty() && db != old_db)
 		tds.run(tds::no_check{u"USE " + brackets_escape(old_db)});
 
-	tds.run("INSERT INTO master.dbo.git_files(id, filename, data) VALUES(?, ?, ?)", commit_id, filename, tds::to_bytes(ddl));
+	if (!ddl.has_value()) {
+		tds.run("INSERT INTO master.dbo.git_files(id, filename, data) VALUES(?, ?, NULL)", commit_id, filename);
+		return;
+	}
+
+	// triggers installed before the setting was passed on the command line
+	if (!compress.has_value()) {
+		tds::query sq(tds, "SELECT git_repo.compress FROM master.dbo.git JOIN master.dbo.git_repo ON git_repo.id = git.repo WHERE git.id = ?", commit_id);
+
+		compress = sq.fetch_row() && !sq[0].is_null && (int)sq[0] != 0;
+	}
+
+	if (compress.value()) {
+		auto gz = gzip(ddl.value());
+
+		tds.run("INSERT INTO master.dbo.git_files(id, filename, data, compressed) VALUES(?, ?, ?, 1)", commit_id, filename, tds::to_bytes(gz));
+	} else
+		tds.run("INSERT INTO master.dbo.git_files(id, filename, data) VALUES(?, ?, ?)", commit_id, filename, tds::to_bytes(ddl.value()));
+}
+
+// How long to wait for a replica to catch up before dumping from the primary instead.
+static const auto replica_wait = chrono::seconds{60};
+static const auto replica_poll = chrono::seconds{5};
+
+// Dumps from the readable secondary or standby named in git_repo.replica, so
+// that the catalog scan doesn't load the primary. Returns false if the replica
+// can't be reached or doesn't catch up in time, in which case the caller should
+// dump from the primary instead.
+//
+// A dump replaces the whole tree, so one from a replica which is behind would
+// revert changes which flush has already committed - and nothing would put them
+// back. Changes which are still queued are fine, as flush will put them on top.
+// So the replica has to have replayed the log as far as synced_lsn, the point
+// that flush and the last dump got to. If that's not been recorded yet, we have
+// to go by where the primary is now.
+static bool dump_from_replica(tds::tds& tds, unsigned int repo_num, const string& server, const string& db,
+							  const string& replica, const optional<string>& synced_lsn,
+							  const filesystem::path& repo_dir, const string& branch, dump_isolation isolation) {
+	auto needed = synced_lsn;
+
+	if (!needed.has_value()) {
+		if (server.empty())
+			needed = primary_log_position(tds, db);
+		else {
+			tds::tds tds2(server, db_username, db_password, db_app);
+
+			needed = primary_log_position(tds2, db);
+		}
+
+		if (!needed.has_value()) {
+			cerr << format("Could not get log position of {} on primary, dumping from primary instead.", db) << endl;
+			return false;
+		}
+	}
+
+	optional<tds::tds> tds3;
+
+	try {
+		tds3.emplace(replica, db_username, db_password, db_app);
+
+		auto deadline = chrono::steady_clock::now() + replica_wait;
+
+		do {
+			auto pos = replica_log_position(tds3.value(), db);
+
+			if (!pos.has_value()) {
+				cerr << format("{} on {} is neither an availability group secondary nor a standby, dumping from primary instead.", db, replica) << endl;
+				return false;
+			}
+
+			if (!lsn_less(pos.value(), needed.value())) {
+				cout << format("Dumping from replica {} (at LSN {}, needed {}).", replica, pos.value(), needed.value()) << endl;
+				break;
+			}
+
+			if (chrono::steady_clock::now() >= deadline) {
+				cerr << format("Replica {} has not caught up after {} seconds (at LSN {}, needed {}), dumping from primary instead.",
+							   replica, replica_wait.count(), pos.value(), needed.value()) << endl;
+				return false;
+			}
+
+			this_thread::sleep_for(replica_poll);
+		} while (true);
+	} catch (const exception& e) {
+		cerr << format("Could not use replica {} ({}), dumping from primary instead.", replica, e.what()) << endl;
+		return false;
+	}
+
+	tds3.value().run(tds::no_check{"USE " + brackets_escape(db)});
+	dump_sql(tds3.value(), db, repo_dir, branch, isolation);
+
+	// the replica may have moved on while we were dumping
+	try {
+		if (auto pos = replica_log_position(tds3.value(), db); pos.has_value())
+			record_synced_lsn(tds, repo_num, pos.value());
+	} catch (const exception& e) {
+		cerr << format("Could not record log position of {}: {}", db, e.what()) << endl;
+	}
+
+	return true;
 }
 
-static void dump_sql2(tds::tds& tds, unsigned int repo_num) {
-	string repo_dir, db, server, branch;
+static void dump_sql2(tds::tds& tds, unsigned int repo_num, dump_isolation isolation) {
+	string repo_dir, db, server, branch, replica;
+	optional<string> synced_lsn;
 
 	{
-		tds::query sq(tds, "SELECT dir, db, server, branch FROM master.dbo.git_repo WHERE id = ?", repo_num);
+		tds::query sq(tds, "SELECT dir, db, server, branch, replica, CONVERT(VARCHAR(25), synced_lsn) FROM master.dbo.git_repo WHERE id = ?", repo_num);
 
 		if (!sq.fetch_row())
 			throw formatted_error("Repo {} not found in master.dbo.git_repo.", repo_num);
@@ -1907,15 +3311,26 @@ static void dump_sql2(tds::tds& tds, unsigned int repo_num) {
 		db = (string)sq[1];
 		server = (string)sq[2];
 		branch = (string)sq[3];
+		replica = (string)sq[4];
+
+		if (!sq[5].is_null)
+			synced_lsn = (string)sq[5];
 	}
 
+	if (branch.empty())
+		branch = "master";
+
+	if (!replica.empty() && dump_from_replica(tds, repo_num, server, db, replica, synced_lsn, repo_dir, branch, isolation))
+		return;
+
 	if (server.empty()) {
 		auto old_db = tds::utf16_to_utf8(tds.db_name());
 
 		if (db != old_db)
 			tds.run(tds::no_check{"USE " + brackets_escape(db)});
 
-		dump_sql(tds, repo_dir, branch.empty() ? "master" : branch);
+		dump_sql(tds, db, repo_dir, branch, isolation);
+		record_primary_position(tds, tds, repo_num, db);
 
 		if (db != old_db)
 			tds.run(tds::no_check{"USE " + brackets_escape(old_db)});
@@ -1923,7 +3338,8 @@ static void dump_sql2(tds::tds& tds, unsigned int repo_num) {
 		tds::tds tds2(server, db_username, db_password, db_app);
 
 		tds2.run(tds::no_check{"USE " + brackets_escape(db)});
-		dump_sql(tds2, repo_dir, branch.empty() ? "master" : branch);
+		dump_sql(tds2, db, repo_dir, branch, isolation);
+		record_primary_position(tds, tds2, repo_num, db);
 	}
 }
 
@@ -1936,6 +3352,35 @@ static bool object_exists(tds::tds& tds, string_view name) {
 	return !sq[0].is_null;
 }
 
+static void add_column(tds::tds& tds, string_view table, string_view column, string_view definition) {
+	{
+		tds::query sq(tds, "SELECT COL_LENGTH(?, ?)", table, column);
+
+		if (!sq.fetch_row())
+			throw formatted_error("Could not check whether column {} exists in {}.", column, table);
+
+		if (!sq[0].is_null)
+			return;
+	}
+
+	cout << format("Adding column {} to {}.\n", column, table);
+
+	tds.run(tds::no_check{"ALTER TABLE " + string(table) + " ADD " + brackets_escape(column) + " " + string(definition)});
+}
+
+static void add_index(tds::tds& tds, string_view table, string_view name, string_view definition) {
+	{
+		tds::query sq(tds, "SELECT 1 FROM sys.indexes WHERE object_id = OBJECT_ID(?) AND name = ?", table, name);
+
+		if (sq.fetch_row())
+			return;
+	}
+
+	cout << format("Creating index {} on {}.\n", name, table);
+
+	tds.run(tds::no_check{"CREATE INDEX " + brackets_escape(name) + " ON " + string(table) + string(definition)});
+}
+
 static string prompt_str(string_view msg) {
 #ifdef _WIN32
 	auto con = GetStdHandle(STD_INPUT_HANDLE);
@@ -1983,14 +3428,46 @@ static string prompt_str(string_view msg) {
 }
 
 static void install_trigger(tds::tds& tds, string_view db, const filesystem::path& exe,
-							unsigned int repo_num) {
+							unsigned int repo_num, bool deferred) {
 	auto escaped_exe = tds::value{exe.string()}.to_literal();
+	bool compress = false;
+
+	// baked into the trigger, so that it doesn't have to be looked up for every event - run
+	// install again if it changes
+	{
+		tds::query sq(tds, "SELECT compress FROM master.dbo.git_repo WHERE id = ?", repo_num);
+
+		if (sq.fetch_row() && !sq[0].is_null)
+			compress = (int)sq[0] != 0;
+	}
+
+	string capture = R"(SET @args = N'object "' + @schema + N'" "' + @tbl + N'" ' + CONVERT(NVARCHAR, @id) + N' "' + @filename + N'" ' + @dbname + N' ' + @kind + N' )"s + (compress ? "1" : "0") + R"(';
+	EXEC @ret = master.dbo.xp_cmd )" + escaped_exe + R"(, @args;
+
+	IF @ret != 0
+		THROW 50000, 'GitSQL failed.', 1;)";
+
+	// only queue the object ID, and leave generating the DDL to flush
+	if (deferred) {
+		capture = R"(IF @kind = N'object'
+		SET @objid = OBJECT_ID(QUOTENAME(@schema) + N'.' + QUOTENAME(@tbl));
+
+	IF @objid IS NOT NULL
+		INSERT INTO master.dbo.git_files(id, filename, data, object_id) VALUES(@id, @filename, NULL, @objid);
+	ELSE
+	BEGIN
+		)" + capture + R"(
+	END;)";
+	}
 
 	tds.run(tds::no_check{"USE " + brackets_escape(db)});
 
 	tds.run(tds::no_check{R"(
 CREATE OR ALTER TRIGGER git_trigger ON DATABASE
-AFTER CREATE_FUNCTION, CREATE_PROCEDURE, CREATE_TABLE, CREATE_VIEW, ALTER_FUNCTION, ALTER_PROCEDURE, ALTER_TABLE, ALTER_VIEW, DROP_FUNCTION, DROP_PROCEDURE, DROP_TABLE, DROP_VIEW, CREATE_INDEX, DROP_INDEX, CREATE_TRIGGER, ALTER_TRIGGER, DROP_TRIGGER, RENAME
+AFTER CREATE_FUNCTION, CREATE_PROCEDURE, CREATE_TABLE, CREATE_VIEW, ALTER_FUNCTION, ALTER_PROCEDURE, ALTER_TABLE, ALTER_VIEW, DROP_FUNCTION, DROP_PROCEDURE, DROP_TABLE, DROP_VIEW, CREATE_INDEX, DROP_INDEX, CREATE_TRIGGER, ALTER_TRIGGER, DROP_TRIGGER, RENAME,
+	CREATE_SYNONYM, DROP_SYNONYM, CREATE_TYPE, DROP_TYPE, CREATE_SCHEMA, DROP_SCHEMA, CREATE_ROLE, DROP_ROLE, ADD_ROLE_MEMBER, DROP_ROLE_MEMBER,
+	CREATE_PARTITION_FUNCTION, ALTER_PARTITION_FUNCTION, DROP_PARTITION_FUNCTION, CREATE_PARTITION_SCHEME, ALTER_PARTITION_SCHEME, DROP_PARTITION_SCHEME,
+	GRANT_DATABASE, DENY_DATABASE, REVOKE_DATABASE, ALTER_ROLE, ALTER_AUTHORIZATION_DATABASE, ALTER_SCHEMA
 AS
 BEGIN
 
@@ -1999,46 +3476,64 @@ SET NOCOUNT ON;
 DECLARE @repo INT = )"s + to_string(repo_num) + R"(;
 
 DECLARE @type NVARCHAR(100), @tbl NVARCHAR(100), @schema NVARCHAR(100), @idx NVARCHAR(100), @login VARCHAR(255), @id INT;
-DECLARE @args NVARCHAR(255), @dir NVARCHAR(20), @msg NVARCHAR(255), @dbname NVARCHAR(100), @objtype NVARCHAR(20), @oldname NVARCHAR(100);
-DECLARE @ret INT;
-DECLARE @idtbl TABLE(id INT);
-
-SELECT @type = EVENTDATA().value('(/EVENT_INSTANCE/EventType)[1]','nvarchar(100)');
-SELECT @tbl = EVENTDATA().value('(/EVENT_INSTANCE/ObjectName)[1]','nvarchar(100)');
-SELECT @schema = EVENTDATA().value('(/EVENT_INSTANCE/SchemaName)[1]','nvarchar(100)');
-SELECT @login = EVENTDATA().value('(/EVENT_INSTANCE/LoginName)[1]','nvarchar(100)');
-SELECT @dbname = EVENTDATA().value('(/EVENT_INSTANCE/DatabaseName)[1]','nvarchar(100)');
+DECLARE @args NVARCHAR(1000), @dir NVARCHAR(20), @msg NVARCHAR(255), @dbname NVARCHAR(100), @objtype NVARCHAR(20), @oldname NVARCHAR(100);
+DECLARE @ret INT, @objid INT;
+DECLARE @event XML = EVENTDATA(), @targettype NVARCHAR(100), @target NVARCHAR(100), @newname NVARCHAR(100), @role NVARCHAR(100);
+DECLARE @kind NVARCHAR(20) = N'object', @filename NVARCHAR(400);
+
+SELECT @type = e.value('(EventType)[1]','nvarchar(100)'),
+	@tbl = e.value('(ObjectName)[1]','nvarchar(100)'),
+	@schema = e.value('(SchemaName)[1]','nvarchar(100)'),
+	@login = e.value('(LoginName)[1]','nvarchar(100)'),
+	@dbname = e.value('(DatabaseName)[1]','nvarchar(100)'),
+	@objtype = e.value('(ObjectType)[1]','nvarchar(100)'),
+	@targettype = e.value('(TargetObjectType)[1]','nvarchar(100)'),
+	@target = e.value('(TargetObjectName)[1]','nvarchar(100)'),
+	@newname = e.value('(NewObjectName)[1]','nvarchar(100)'),
+	@role = e.value('(RoleName)[1]','nvarchar(100)')
+FROM @event.nodes('/EVENT_INSTANCE') AS ev(e);
+
+IF (@type = N'CREATE_TRIGGER' OR @type = N'ALTER_TRIGGER' OR @type = N'DROP_TRIGGER') AND (@targettype IS NULL OR @targettype = N'DATABASE')
+BEGIN
+	IF @tbl = N'git_trigger'
+		RETURN;
 
-IF @type = N'CREATE_INDEX' OR @type = N'DROP_INDEX' OR @type = N'CREATE_TRIGGER' OR @type = N'ALTER_TRIGGER' OR @type = N'DROP_TRIGGER'
+	SET @kind = N'db_trigger';
+END
+ELSE IF @type = N'CREATE_INDEX' OR @type = N'DROP_INDEX' OR @type = N'CREATE_TRIGGER' OR @type = N'ALTER_TRIGGER' OR @type = N'DROP_TRIGGER'
 BEGIN
-	IF EVENTDATA().value('(/EVENT_INSTANCE/TargetObjectType)[1]','nvarchar(100)') != N'TABLE'
+	IF @targettype != N'TABLE'
 		RETURN;
 
 	SET @idx = @tbl;
-	SET @tbl = EVENTDATA().value('(/EVENT_INSTANCE/TargetObjectName)[1]','nvarchar(100)');
+	SET @tbl = @target;
 END;
 
 IF @type = N'RENAME'
 BEGIN
-	SET @objtype = EVENTDATA().value('(/EVENT_INSTANCE/ObjectType)[1]','nvarchar(100)');
-
 	IF @objtype != 'TABLE' AND @objtype != 'VIEW' AND @objtype != 'FUNCTION' AND @objtype != 'PROCEDURE' AND @objtype != 'INDEX'
 		RETURN;
 
 	IF @objtype = 'INDEX'
 	BEGIN
 		SET @oldname = @tbl;
-		SET @idx = EVENTDATA().value('(/EVENT_INSTANCE/NewObjectName)[1]','nvarchar(100)');
-		SET @tbl = EVENTDATA().value('(/EVENT_INSTANCE/TargetObjectName)[1]','nvarchar(100)');
+		SET @idx = @newname;
+		SET @tbl = @target;
 	END
 	ELSE
 	BEGIN
 		SET @oldname = @tbl;
-		SET @tbl = EVENTDATA().value('(/EVENT_INSTANCE/NewObjectName)[1]','nvarchar(100)');
+		SET @tbl = @newname;
 	END;
 END;
 
-IF @type = N'CREATE_FUNCTION'
+IF @kind = N'db_trigger'
+BEGIN
+	SET @schema = N'';
+	SET @filename = N'db_triggers/' + @tbl + N'.sql';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @tbl;
+END
+ELSE IF @type = N'CREATE_FUNCTION'
 BEGIN
 	SET @dir = 'functions';
 	SET @msg = N'CREATE FUNCTION ' + @schema + N'.' + @tbl;
@@ -2150,25 +3645,164 @@ BEGIN
 		SET @dir = 'tables';
 		SET @msg = N'RENAME INDEX ' + @oldname + N' ON ' + @schema + N'.' + @tbl + N' TO ' + @idx;
 	END;
+END
+ELSE IF @type = N'CREATE_SYNONYM' OR @type = N'DROP_SYNONYM'
+BEGIN
+	SET @dir = 'synonyms';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @schema + N'.' + @tbl;
+END
+ELSE IF @type = N'CREATE_TYPE' OR @type = N'DROP_TYPE'
+BEGIN
+	SET @kind = N'type';
+	SET @dir = 'types';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @schema + N'.' + @tbl;
+END
+ELSE IF @type = N'CREATE_SCHEMA' OR @type = N'DROP_SCHEMA'
+BEGIN
+	SET @kind = N'schema';
+	SET @schema = N'';
+	SET @filename = N'schemas/' + @tbl + N'.sql';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @tbl;
+END
+ELSE IF @type = N'CREATE_ROLE' OR @type = N'DROP_ROLE'
+BEGIN
+	SET @kind = N'role';
+	SET @schema = N'';
+	SET @filename = N'principals/' + @tbl + N'.sql';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @tbl;
+END
+ELSE IF @type = N'ADD_ROLE_MEMBER' OR @type = N'DROP_ROLE_MEMBER'
+BEGIN
+	SET @kind = N'role';
+	SET @schema = N'';
+	SET @filename = N'principals/' + @role + N'.sql';
+	SET @msg = N'ALTER ROLE ' + @role + CASE WHEN @type = N'ADD_ROLE_MEMBER' THEN N' ADD MEMBER ' ELSE N' DROP MEMBER ' END + @tbl;
+	SET @tbl = @role;
+END
+ELSE IF @type = N'CREATE_PARTITION_FUNCTION' OR @type = N'ALTER_PARTITION_FUNCTION' OR @type = N'DROP_PARTITION_FUNCTION'
+BEGIN
+	SET @kind = N'partition_function';
+	SET @schema = N'';
+	SET @filename = N'partition_functions/' + @tbl + N'.sql';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @tbl;
+END
+ELSE IF @type = N'CREATE_PARTITION_SCHEME' OR @type = N'ALTER_PARTITION_SCHEME' OR @type = N'DROP_PARTITION_SCHEME'
+BEGIN
+	SET @kind = N'partition_scheme';
+	SET @schema = N'';
+	SET @filename = N'partition_schemes/' + @tbl + N'.sql';
+	SET @msg = REPLACE(@type, N'_', N' ') + N' ' + @tbl;
+END
+ELSE IF (@type = N'GRANT_DATABASE' OR @type = N'DENY_DATABASE' OR @type = N'REVOKE_DATABASE') AND @objtype = N'SCHEMA'
+BEGIN
+	SET @kind = N'schema';
+	SET @schema = N'';
+	SET @filename = N'schemas/' + @tbl + N'.sql';
+	SET @msg = REPLACE(@type, N'_DATABASE', N'') + N' ON SCHEMA :: ' + @tbl;
+END
+ELSE IF @type = N'GRANT_DATABASE' OR @type = N'DENY_DATABASE' OR @type = N'REVOKE_DATABASE'
+BEGIN
+	-- only the GRANT section at the end of the file changes, which flush rewrites
+	SET @objid = OBJECT_ID(QUOTENAME(@schema) + N'.' + QUOTENAME(@tbl));
+
+	SELECT @dir = CASE RTRIM(type)
+		WHEN 'U' THEN 'tables'
+		WHEN 'V' THEN 'views'
+		WHEN 'P' THEN 'procedures'
+		WHEN 'FN' THEN 'functions'
+		WHEN 'TF' THEN 'functions'
+		WHEN 'IF' THEN 'functions'
+		WHEN 'SN' THEN 'synonyms'
+	END
+	FROM sys.objects
+	WHERE object_id = @objid;
+
+	IF @dir IS NULL
+		RETURN;
+
+	SET @kind = N'perms';
+	SET @msg = REPLACE(@type, N'_DATABASE', N'') + N' ON ' + @schema + N'.' + @tbl;
+END
+ELSE IF @type = N'ALTER_ROLE'
+BEGIN
+	SET @kind = N'role';
+	SET @schema = N'';
+	SET @msg = N'ALTER ROLE ' + @tbl;
+
+	IF @newname IS NOT NULL AND @newname != @tbl
+	BEGIN
+		SET @oldname = @tbl;
+		SET @tbl = @newname;
+		SET @msg = N'ALTER ROLE ' + @oldname + N' WITH NAME = ' + @tbl;
+	END;
+
+	SET @filename = N'principals/' + @tbl + N'.sql';
+END
+ELSE IF @type = N'ALTER_AUTHORIZATION_DATABASE' AND @objtype = N'SCHEMA'
+BEGIN
+	SET @kind = N'schema';
+	SET @schema = N'';
+	SET @filename = N'schemas/' + @tbl + N'.sql';
+	SET @msg = N'ALTER AUTHORIZATION ON SCHEMA :: ' + @tbl;
+END
+ELSE IF @type = N'ALTER_AUTHORIZATION_DATABASE' AND @objtype = N'ROLE'
+BEGIN
+	SET @kind = N'role';
+	SET @schema = N'';
+	SET @filename = N'principals/' + @tbl + N'.sql';
+	SET @msg = N'ALTER AUTHORIZATION ON ROLE :: ' + @tbl;
+END
+ELSE IF @type = N'ALTER_AUTHORIZATION_DATABASE'
+	RETURN;
+ELSE IF @type = N'ALTER_SCHEMA'
+BEGIN
+	-- ALTER SCHEMA ... TRANSFER - SchemaName is the schema the object has moved to
+	IF @objtype = N'TYPE'
+	BEGIN
+		SET @kind = N'type';
+		SET @dir = 'types';
+	END
+	ELSE
+	BEGIN
+		SELECT @dir = CASE RTRIM(type)
+			WHEN 'U' THEN 'tables'
+			WHEN 'V' THEN 'views'
+			WHEN 'P' THEN 'procedures'
+			WHEN 'FN' THEN 'functions'
+			WHEN 'TF' THEN 'functions'
+			WHEN 'IF' THEN 'functions'
+			WHEN 'SN' THEN 'synonyms'
+		END
+		FROM sys.objects
+		WHERE object_id = OBJECT_ID(QUOTENAME(@schema) + N'.' + QUOTENAME(@tbl));
+
+		IF @dir IS NULL
+			RETURN;
+	END;
+
+	SET @msg = N'ALTER SCHEMA ' + @schema + N' TRANSFER ' + @tbl;
 END;
 
+IF @filename IS NULL
+	SET @filename = @schema + N'/' + @dir + N'/' + @tbl + N'.sql';
+
 BEGIN TRANSACTION;
 
-INSERT INTO master.dbo.git(repo, username, description, dto, tran_id) OUTPUT inserted.id INTO @idtbl VALUES(@repo, @login, @msg, SYSDATETIMEOFFSET(), CURRENT_TRANSACTION_ID());
-SET @id = (SELECT id FROM @idtbl);
+INSERT INTO master.dbo.git(repo, username, description, dto, tran_id, spid) VALUES(@repo, @login, @msg, SYSDATETIMEOFFSET(), CURRENT_TRANSACTION_ID(), @@SPID);
+SET @id = SCOPE_IDENTITY();
 
-IF @type = N'DROP_FUNCTION' OR @type = N'DROP_PROCEDURE' OR @type = N'DROP_TABLE' OR @type = N'DROP_VIEW'
-	INSERT INTO master.dbo.git_files(id, filename, data) VALUES(@id, @schema + N'/' + @dir + N'/' + @tbl + N'.sql', NULL);
+IF @kind = N'perms'
+	INSERT INTO master.dbo.git_files(id, filename, data, object_id, perms) VALUES(@id, @filename, NULL, @objid, 1);
+ELSE IF (@type LIKE N'DROP[_]%' AND @type != N'DROP_INDEX' AND @type != N'DROP_TRIGGER' AND @type != N'DROP_ROLE_MEMBER') OR (@type = N'DROP_TRIGGER' AND @kind = N'db_trigger')
+	INSERT INTO master.dbo.git_files(id, filename, data) VALUES(@id, @filename, NULL);
 ELSE
 BEGIN
-	SET @args = N'object "' + @schema + N'" "' + @tbl + N'" ' + CONVERT(NVARCHAR, @id) + N' "' + @schema + N'/' + @dir + N'/' + @tbl + N'.sql" ' + @dbname;
-	EXEC @ret = master.dbo.xp_cmd )" + escaped_exe + R"(, @args;
-
-	IF @ret != 0
-		THROW 50000, 'GitSQL failed.', 1;
+	)" + capture + R"(
 
 	IF @type = N'RENAME' AND @objtype != N'INDEX'
 		INSERT INTO master.dbo.git_files(id, filename, data) VALUES(@id, @schema + N'/' + @dir + N'/' + @oldname + N'.sql', NULL);
+	ELSE IF @type = N'ALTER_ROLE' AND @oldname IS NOT NULL
+		INSERT INTO master.dbo.git_files(id, filename, data) VALUES(@id, N'principals/' + @oldname + N'.sql', NULL);
 END;
 
 COMMIT;
@@ -2235,11 +3869,31 @@ static void install(tds::tds& tds) {
 	dir VARCHAR(260) NOT NULL,
 	db VARCHAR(255) NULL,
 	branch VARCHAR(50) NULL,
-	server VARCHAR(15) NULL
+	server VARCHAR(15) NULL,
+	push_debounce INT NULL,
+	push_max_latency INT NULL,
+	push_timeout INT NULL,
+	compress BIT NULL,
+	replica VARCHAR(255) NULL,
+	synced_lsn DECIMAL(25,0) NULL,
+	squash_window INT NULL,
+	squash_spid BIT NULL,
+	squash_max INT NULL
 );)");
-	} else
+	} else {
 		cout << "Table master.dbo.git_repo already exists.\n";
 
+		add_column(tds, "dbo.git_repo", "push_debounce", "INT NULL");
+		add_column(tds, "dbo.git_repo", "push_max_latency", "INT NULL");
+		add_column(tds, "dbo.git_repo", "push_timeout", "INT NULL");
+		add_column(tds, "dbo.git_repo", "compress", "BIT NULL");
+		add_column(tds, "dbo.git_repo", "replica", "VARCHAR(255) NULL");
+		add_column(tds, "dbo.git_repo", "synced_lsn", "DECIMAL(25,0) NULL");
+		add_column(tds, "dbo.git_repo", "squash_window", "INT NULL");
+		add_column(tds, "dbo.git_repo", "squash_spid", "BIT NULL");
+		add_column(tds, "dbo.git_repo", "squash_max", "INT NULL");
+	}
+
 	if (!object_exists(tds, "dbo.git")) {
 		cout << "Creating table master.dbo.git.\n";
 
@@ -2249,11 +3903,15 @@ static void install(tds::tds& tds) {
 	username NVARCHAR(MAX) NOT NULL,
 	description VARCHAR(MAX) NOT NULL,
 	dto DATETIMEOFFSET(0) NOT NULL,
-	tran_id BIGINT NULL
+	tran_id BIGINT NULL,
+	spid SMALLINT NULL
 );)");
-	} else
+	} else {
 		cout << "Table master.dbo.git already exists.\n";
 
+		add_column(tds, "dbo.git", "spid", "SMALLINT NULL");
+	}
+
 	if (!object_exists(tds, "dbo.git_files")) {
 		cout << "Creating table master.dbo.git_files.\n";
 
@@ -2261,11 +3919,49 @@ static void install(tds::tds& tds) {
 	file_id INT IDENTITY NOT NULL PRIMARY KEY,
 	id INT NOT NULL FOREIGN KEY REFERENCES dbo.git(id),
 	filename VARCHAR(260),
-	data VARBINARY(MAX) NULL
+	data VARBINARY(MAX) NULL,
+	object_id INT NULL,
+	compressed BIT NOT NULL DEFAULT 0,
+	perms BIT NOT NULL DEFAULT 0
 );)");
-	} else
+	} else {
 		cout << "Table master.dbo.git_files already exists.\n";
 
+		add_column(tds, "dbo.git_files", "object_id", "INT NULL");
+		add_column(tds, "dbo.git_files", "compressed", "BIT NOT NULL DEFAULT 0");
+		add_column(tds, "dbo.git_files", "perms", "BIT NOT NULL DEFAULT 0");
+	}
+
+	// so that flush can seek to the next entry in the queue, rather than scanning it
+	add_index(tds, "dbo.git", "IX_git_repo_id", "(repo, id)");
+	add_index(tds, "dbo.git", "IX_git_tran_id", "(tran_id)");
+	add_index(tds, "dbo.git_files", "IX_git_files_id", "(id)");
+
+	// Memory-optimized tables aren't allowed in master, but on SQL Server 2019 and later we can at
+	// least stop concurrent triggers fighting over the last page of the identity indexes.
+
+	int version;
+
+	{
+		tds::query sq(tds, "SELECT CONVERT(INT, SERVERPROPERTY('ProductMajorVersion'))");
+
+		if (!sq.fetch_row() || sq[0].is_null)
+			throw runtime_error("Could not get SQL Server version.");
+
+		version = (int)sq[0];
+	}
+
+	if (version >= 15) {
+		auto seqkey = prompt_str("Optimize queue tables for many concurrent DDL statements? (y/N)");
+
+		if (seqkey == "y" || seqkey == "Y") {
+			cout << "Setting OPTIMIZE_FOR_SEQUENTIAL_KEY on dbo.git and dbo.git_files.\n";
+
+			tds.run("ALTER INDEX ALL ON dbo.git SET (OPTIMIZE_FOR_SEQUENTIAL_KEY = ON)");
+			tds.run("ALTER INDEX ALL ON dbo.git_files SET (OPTIMIZE_FOR_SEQUENTIAL_KEY = ON)");
+		}
+	}
+
 	cout << "Granting INSERT permissions on dbo.git to public.\n";
 	tds.run("GRANT INSERT ON dbo.git TO public");
 
@@ -2378,8 +4074,11 @@ static void install(tds::tds& tds) {
 				if (!branch.empty())
 					branchv = branch;
 
+				auto compress = prompt_str("Compress DDL while it is waiting to be committed? (y/N)");
+
 				{
-					tds::query sq(tds, "INSERT INTO master.dbo.git_repo(dir, db, branch) OUTPUT inserted.id VALUES(?, ?, ?)", path, db, branchv);
+					tds::query sq(tds, "INSERT INTO master.dbo.git_repo(dir, db, branch, compress) OUTPUT inserted.id VALUES(?, ?, ?, ?)", path, db, branchv,
+								  compress == "y" || compress == "Y" ? 1 : 0);
 
 					if (!sq.fetch_row())
 						throw runtime_error("Could not get ID of new repository.");
@@ -2392,12 +4091,14 @@ static void install(tds::tds& tds) {
 				do_dump = true;
 			}
 
+			auto deferred = prompt_str("Generate DDL when flushing rather than within the trigger? (y/N)");
+
 			cout << "Installing trigger.\n";
-			install_trigger(tds, db, get_exe_path(), repo_num.value());
+			install_trigger(tds, db, get_exe_path(), repo_num.value(), deferred == "y" || deferred == "Y");
 
 			if (do_dump) {
 				cout << "Doing initial dump.\n";
-				dump_sql2(tds, repo_num.value());
+				dump_sql2(tds, repo_num.value(), dump_isolation::none);
 			}
 		}
 	}
@@ -2445,9 +4146,10 @@ static optional<string> get_environment_variable(const string& name) {
 static void print_usage() {
 	cerr << R"(Usage:
     gitsql flush
-    gitsql object <schema> <object> <commit> <filename> [database]
-    gitsql dump <repo-id>
-    gitsql show <object>
+    gitsql push [repo-id]
+    gitsql object <schema> <object> <commit> <filename> [database] [kind] [compress]
+    gitsql dump [--snapshot | --db-snapshot] <repo-id>
+    gitsql show [--json] <object>... | - | @<file>
     gitsql show <database> <object id>
     gitsql master <repo> <smk>
     gitsql install <server>
@@ -2473,7 +4175,7 @@ int main(int argc, char* argv[])
 	string_view cmd = argv[1];
 #endif
 
-	if (cmd != "flush" && cmd != "object" && cmd != "dump" && cmd != "show" && cmd != "master" && cmd != "install") {
+	if (cmd != "flush" && cmd != "push" && cmd != "object" && cmd != "dump" && cmd != "show" && cmd != "master" && cmd != "install") {
 		print_usage();
 		return 1;
 	}
@@ -2546,6 +4248,28 @@ int main(int argc, char* argv[])
 			lockfile lf;
 
 			flush_git(db_server);
+		} else if (cmd == "push") {
+			optional<unsigned int> repo_id;
+
+			if (argc >= 3) {
+#ifdef _WIN32
+				auto repo_str = tds::utf16_to_utf8((char16_t*)argv[2]);
+#else
+				string_view repo_str = argv[2];
+#endif
+				unsigned int v;
+
+				auto [ptr, ec] = from_chars(repo_str.data(), repo_str.data() + repo_str.length(), v);
+
+				if (ptr != repo_str.data() + repo_str.length())
+					throw formatted_error("Unable to interpret \"{}\" as integer.", repo_str);
+
+				repo_id = v;
+			}
+
+			lockfile lf;
+
+			push_pending(db_server, repo_id);
 		} else if (cmd == "object") {
 			if (argc < 6)
 				throw runtime_error("Too few arguments.");
@@ -2581,11 +4305,15 @@ int main(int argc, char* argv[])
 			u16string_view object = (char16_t*)argv[3];
 			u16string_view filename = (char16_t*)argv[5];
 			u16string_view db = argc >= 7 ? (char16_t*)argv[6] : u"";
+			auto kind = argc >= 8 ? tds::utf16_to_utf8((char16_t*)argv[7]) : "object";
+			auto compress = argc >= 9 ? optional<bool>{u16string_view((char16_t*)argv[8]) == u"1"} : nullopt;
 #else
 			string_view u8schema = argv[2];
 			string_view u8object = argv[3];
 			string_view u8filename = argv[5];
 			string_view u8db = argc >= 7 ? argv[6] : "";
+			string_view kind = argc >= 8 ? argv[7] : "object";
+			auto compress = argc >= 9 ? optional<bool>{string_view(argv[8]) == "1"} : nullopt;
 
 			auto schema = tds::utf8_to_utf16(u8schema);
 			auto object = tds::utf8_to_utf16(u8object);
@@ -2594,15 +4322,35 @@ int main(int argc, char* argv[])
 #endif
 			tds::tds tds(db_server, db_username, db_password, db_app);
 
-			write_object_ddl(tds, schema, object, bind_token, commit_id, filename, db);
+			write_object_ddl(tds, schema, object, bind_token, commit_id, filename, db, kind, compress);
 		} else if (cmd == "dump") {
 			unsigned int repo_id;
+			auto isolation = dump_isolation::none;
+			int arg = 2;
+
+			for (; arg < argc - 1; arg++) {
+#ifdef _WIN32
+				auto opt = tds::utf16_to_utf8((char16_t*)argv[arg]);
+#else
+				string_view opt = argv[arg];
+#endif
+
+				if (opt == "--snapshot")
+					isolation = dump_isolation::snapshot;
+				else if (opt == "--db-snapshot")
+					isolation = dump_isolation::database_snapshot;
+				else
+					throw formatted_error("Unrecognized option \"{}\".", opt);
+			}
+
+			if (arg >= argc)
+				throw runtime_error("Too few arguments.");
 
 			{
 #ifdef _WIN32
-				auto repo_id_str = tds::utf16_to_utf8(argv[2]);
+				auto repo_id_str = tds::utf16_to_utf8((char16_t*)argv[arg]);
 #else
-				string repo_id_str = argv[2];
+				string repo_id_str = argv[arg];
 #endif
 
 				auto [ptr, ec] = from_chars(repo_id_str.data(), repo_id_str.data() + repo_id_str.length(), repo_id);
@@ -2614,7 +4362,7 @@ int main(int argc, char* argv[])
 			lockfile lf;
 			tds::tds tds(db_server, db_username, db_password, db_app);
 
-			dump_sql2(tds, repo_id);
+			dump_sql2(tds, repo_id, isolation);
 		} else if (cmd == "show") {
 			if (argc < 3)
 				throw runtime_error("Too few arguments.");
@@ -2630,6 +4378,16 @@ int main(int argc, char* argv[])
 				bind_token = tds::utf8_to_utf16(bind_token_u8.value());
 #endif
 
+			vector<string> args;
+
+			for (int i = 2; i < argc; i++) {
+#ifdef _WIN32
+				args.emplace_back(tds::utf16_to_utf8((char16_t*)argv[i]));
+#else
+				args.emplace_back(argv[i]);
+#endif
+			}
+
 			tds::tds tds(db_server, db_username, db_password, db_app);
 
 			if (bind_token.has_value()) {
@@ -2638,21 +4396,10 @@ int main(int argc, char* argv[])
 				while (r.fetch_row()) { } // wait for last packet
 			}
 
-			if (argc >= 4) {
+			if (args.size() == 2 && !args[1].empty() && ranges::all_of(args[1], [](char c) { return c >= '0' && c <= '9'; })) {
 				int32_t id;
-
-#ifdef _WIN32
-				u16string_view db = (char16_t*)argv[2];
-#else
-				string_view u8db = argv[2];
-				auto db = tds::utf8_to_utf16(u8db);
-#endif
-
-#ifdef _WIN32
-				auto id_str = tds::utf16_to_utf8(argv[3]);
-#else
-				string id_str = argv[3];
-#endif
+				auto db = tds::utf8_to_utf16(args[0]);
+				const auto& id_str = args[1];
 
 				auto [ptr, ec] = from_chars(id_str.data(), id_str.data() + id_str.length(), id);
 
@@ -2666,26 +4413,30 @@ int main(int argc, char* argv[])
 
 				cout << ddl;
 			} else {
-#ifdef _WIN32
-				u16string_view object = (char16_t*)argv[2];
-#else
-				string_view u8object = argv[2];
-				auto object = tds::utf8_to_utf16(u8object);
-#endif
-
-				auto onp = tds::parse_object_name(object);
-
-				if (!onp.server.empty())
-					throw runtime_error("Cannot show definition of objects on remote servers.");
-
-				if (!onp.db.empty())
-					tds.run(tds::no_check{u"USE " + brackets_escape(onp.db)});
-				else if (!onp.name.empty() && onp.name.front() == u'#')
-					tds.run(u"USE tempdb");
+				vector<u16string> objects;
+				bool json_output = false;
+
+				for (const auto& a : args) {
+					if (a == "--json")
+						json_output = true;
+					else if (a == "-")
+						read_object_list(cin, objects);
+					else if (!a.empty() && a.front() == '@') {
+						ifstream f(filesystem::path{a.substr(1)});
+
+						if (!f.is_open())
+							throw formatted_error("Could not open {} for reading.", a.substr(1));
+
+						read_object_list(f, objects);
+					} else
+						objects.emplace_back(tds::utf8_to_utf16(a));
+				}
 
-				auto ddl = object_ddl(tds, onp.schema, onp.name);
+				if (objects.empty())
+					throw runtime_error("No objects specified.");
 
-				cout << ddl;
+				if (!show_objects(tds, objects, json_output))
+					return 1;
 			}
 		} else if (cmd == "master") {
 			unsigned int repo;
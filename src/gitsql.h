@@ -87,7 +87,11 @@ struct git_update;
 // gitsql.cpp
 std::string get_current_username();
 void get_current_user_details(std::string& name, std::string& email);
-void do_dump_sql(tds::tds& tds, git_update& gu);
+void do_dump_sql(tds::tds& tds, git_update& gu, std::string_view db);
+
+// git.cpp
+std::string gzip(std::string_view data);
+std::string gunzip(std::span<const uint8_t> data);
 
 // table.cpp
 std::string table_ddl(tds::tds& tds, int64_t id, bool nolock);
@@ -101,6 +105,7 @@ void get_ldap_details_from_sid(PSID sid, std::string& name, std::string& email);
 #else
 void get_ldap_details_from_name(std::string_view username, std::string& name, std::string& email);
 void get_ldap_details_from_full_name(std::string_view username, std::string& name, std::string& email);
+void prefetch_ldap_details(std::span<const std::string> usernames);
 #endif
 
 // parse.cpp
@@ -16,9 +16,14 @@
 #include <string>
 #include <memory>
 #include <unordered_map>
+#include <filesystem>
+#include <fstream>
+#include <chrono>
+#include <nlohmann/json.hpp>
 #include "outptr.h"
 
 using namespace std;
+using json = nlohmann::json;
 
 struct string_hash {
 	using hash_type = hash<string_view>;
@@ -38,8 +43,24 @@ struct string_hash {
 
 };
 
-static unordered_map<string, pair<string, string>, string_hash, equal_to<>> ldap_cache;
-static unordered_map<string, string, string_hash, equal_to<>> ldap_domain;
+struct ldap_user {
+	string name;
+	string email;
+	int64_t time;
+};
+
+struct ldap_naming_context {
+	string context;
+	int64_t time;
+};
+
+static unordered_map<string, ldap_user, string_hash, equal_to<>> ldap_cache;
+static unordered_map<string, ldap_naming_context, string_hash, equal_to<>> ldap_domain;
+static bool ldap_cache_loaded = false;
+
+// seconds for which lookups are remembered on disk - users not found are retried sooner
+static const int64_t ldap_cache_ttl = 24 * 60 * 60;
+static const int64_t ldap_negative_cache_ttl = 60 * 60;
 
 class ldap_error : public exception {
 public:
@@ -90,11 +111,16 @@ public:
 	map<string, string> search(const string& filter, const vector<string>& atts);
 	map<string, string> search_context(const string& filter, const vector<string>& atts,
 									   const string& context);
+#ifndef _WIN32
+	int search_async(const string& filter, const vector<string>& atts, const string& context);
+	vector<map<string, string>> search_result(int msgid);
+#endif
 
 	string naming_context;
 
 private:
 	void find_naming_context();
+	map<string, string> entry_attributes(LDAPMessage* entry);
 
 	ldap_t ld;
 };
@@ -214,13 +240,34 @@ void ldapobj::find_naming_context() {
 		throw runtime_error("Could not get LDAP naming context.");
 }
 
+map<string, string> ldapobj::entry_attributes(LDAPMessage* entry) {
+	char* att;
+	BerElement* ber = nullptr;
+	map<string, string> values;
+
+	att = ldap_first_attribute(ld.get(), entry, &ber);
+
+	while (att) {
+		bervals_ptr bv{ldap_get_values_len(ld.get(), entry, att)};
+
+		if (bv && ldap_count_values_len(bv.get()) > 0)
+			values[att] = string_view(bv.get()[0]->bv_val, bv.get()[0]->bv_len);
+		else
+			values[att] = "";
+
+		att = ldap_next_attribute(ld.get(), entry, ber);
+	}
+
+	if (ber)
+		ber_free(ber, 0);
+
+	return values;
+}
+
 map<string, string> ldapobj::search_context(const string& filter, const vector<string>& atts,
 											const string& context) {
-	char* att;
 	ldap_message res;
-	BerElement* ber = nullptr;
 	vector<char*> attlist;
-	map<string, string> values;
 
 	if (!atts.empty()) {
 		for (const auto& att : atts) {
@@ -237,29 +284,307 @@ map<string, string> ldapobj::search_context(const string& filter, const vector<s
 	if (ret != LDAP_SUCCESS)
 		throw ldap_error("ldap_search_ext_s", ret);
 
-	att = ldap_first_attribute(ld.get(), res.get(), &ber);
+	return entry_attributes(res.get());
+}
 
-	while (att) {
-		bervals_ptr bv{ldap_get_values_len(ld.get(), res.get(), att)};
+#ifndef _WIN32
 
-		if (bv && ldap_count_values_len(bv.get()) > 0)
-			values[att] = string_view(bv.get()[0]->bv_val, bv.get()[0]->bv_len);
-		else
-			values[att] = "";
+int ldapobj::search_async(const string& filter, const vector<string>& atts, const string& context) {
+	vector<char*> attlist;
+	int msgid;
 
-		att = ldap_next_attribute(ld.get(), res.get(), ber);
+	for (const auto& att : atts) {
+		attlist.push_back((char*)att.c_str());
 	}
 
-	if (ber)
-		ber_free(ber, 0);
+	attlist.push_back(nullptr);
 
-	return values;
+	auto ret = ldap_search_ext(ld.get(), context.c_str(), LDAP_SCOPE_SUBTREE, filter.c_str(),
+							   &attlist[0], false, nullptr, nullptr, nullptr, 0, &msgid);
+
+	if (ret != LDAP_SUCCESS)
+		throw ldap_error("ldap_search_ext", ret);
+
+	return msgid;
+}
+
+vector<map<string, string>> ldapobj::search_result(int msgid) {
+	ldap_message res;
+	vector<map<string, string>> entries;
+	int err;
+
+	auto ret = ldap_result(ld.get(), msgid, LDAP_MSG_ALL, nullptr, out_ptr(res));
+
+	if (ret == -1)
+		throw runtime_error("ldap_result failed.");
+
+	ret = ldap_parse_result(ld.get(), res.get(), &err, nullptr, nullptr, nullptr, nullptr, 0);
+
+	if (ret != LDAP_SUCCESS)
+		throw ldap_error("ldap_parse_result", ret);
+
+	if (err != LDAP_SUCCESS)
+		throw ldap_error("ldap_search_ext", err);
+
+	for (auto entry = ldap_first_entry(ld.get(), res.get()); entry; entry = ldap_next_entry(ld.get(), entry)) {
+		entries.emplace_back(entry_attributes(entry));
+	}
+
+	return entries;
 }
 
+#endif
+
 map<string, string> ldapobj::search(const string& filter, const vector<string>& atts) {
 	return search_context(filter, atts, naming_context);
 }
 
+static int64_t cache_now() {
+	return chrono::duration_cast<chrono::seconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+static filesystem::path ldap_cache_file() {
+#ifdef _WIN32
+	auto dir = getenv("LOCALAPPDATA");
+
+	if (!dir)
+		return {};
+
+	return filesystem::path{dir} / "gitsql" / "ldap-cache";
+#else
+	if (auto dir = getenv("XDG_CACHE_HOME"); dir && dir[0] != 0)
+		return filesystem::path{dir} / "gitsql" / "ldap-cache";
+
+	auto home = getenv("HOME");
+
+	if (!home)
+		return {};
+
+	return filesystem::path{home} / ".cache" / "gitsql" / "ldap-cache";
+#endif
+}
+
+static bool ldap_user_expired(const ldap_user& u, int64_t now) {
+	if (u.name.empty() && u.email.empty())
+		return now - u.time >= ldap_negative_cache_ttl;
+	else
+		return now - u.time >= ldap_cache_ttl;
+}
+
+static json ldap_user_json(string_view key, const ldap_user& u) {
+	auto j = json::object();
+
+	j["user"] = key;
+	j["name"] = u.name;
+	j["email"] = u.email;
+	j["time"] = u.time;
+
+	return j;
+}
+
+static json ldap_domain_json(string_view key, const ldap_naming_context& d) {
+	auto j = json::object();
+
+	j["domain"] = key;
+	j["context"] = d.context;
+	j["time"] = d.time;
+
+	return j;
+}
+
+static void rewrite_ldap_cache(const filesystem::path& fn) {
+	auto tmp = fn;
+
+	tmp += ".tmp";
+
+	{
+		ofstream f(tmp, ios::trunc);
+
+		if (!f.good())
+			return;
+
+		for (const auto& u : ldap_cache) {
+			f << ldap_user_json(u.first, u.second).dump() << "\n";
+		}
+
+		for (const auto& d : ldap_domain) {
+			f << ldap_domain_json(d.first, d.second).dump() << "\n";
+		}
+
+		if (!f.good())
+			return;
+	}
+
+	filesystem::rename(tmp, fn);
+}
+
+// The cache file is append-only, one JSON object per line, with later lines overriding
+// earlier ones. Expired entries are dropped when loading, and the file is rewritten if
+// most of it turns out to be stale.
+static void load_ldap_cache() {
+	if (ldap_cache_loaded)
+		return;
+
+	ldap_cache_loaded = true;
+
+	try {
+		auto fn = ldap_cache_file();
+
+		if (fn.empty())
+			return;
+
+		ifstream f(fn);
+
+		if (!f.good())
+			return;
+
+		auto now = cache_now();
+		size_t lines = 0, bad = 0;
+		string line;
+
+		while (getline(f, line)) {
+			lines++;
+
+			// a line might be truncated if we were killed while appending to it - skip it, and
+			// let the rewrite below drop it
+			try {
+				auto j = json::parse(line);
+
+				if (j.contains("user")) {
+					ldap_user u{j["name"].get<string>(), j["email"].get<string>(), j["time"].get<int64_t>()};
+
+					if (ldap_user_expired(u, now))
+						ldap_cache.erase(j["user"].get<string>());
+					else
+						ldap_cache.insert_or_assign(j["user"].get<string>(), move(u));
+				} else if (j.contains("domain")) {
+					ldap_naming_context d{j["context"].get<string>(), j["time"].get<int64_t>()};
+
+					if (now - d.time >= ldap_cache_ttl)
+						ldap_domain.erase(j["domain"].get<string>());
+					else
+						ldap_domain.insert_or_assign(j["domain"].get<string>(), move(d));
+				}
+			} catch (const exception&) {
+				bad++;
+			}
+		}
+
+		f.close();
+
+		if (bad > 0)
+			cerr << "Skipped " << bad << " bad line" << (bad == 1 ? "" : "s") << " in LDAP cache." << endl;
+
+		if (bad > 0 || (lines > 100 && lines > 2 * (ldap_cache.size() + ldap_domain.size())))
+			rewrite_ldap_cache(fn);
+	} catch (const exception& e) {
+		cerr << "Error reading LDAP cache: " << e.what() << endl;
+	}
+}
+
+static void append_ldap_cache(const json& j) {
+	try {
+		auto fn = ldap_cache_file();
+
+		if (fn.empty())
+			return;
+
+		filesystem::create_directories(fn.parent_path());
+
+		ofstream f(fn, ios::app);
+
+		f << j.dump() << "\n";
+	} catch (const exception& e) {
+		cerr << "Error writing LDAP cache: " << e.what() << endl;
+	}
+}
+
+static bool find_cached_user(string_view key, string& name, string& email) {
+	load_ldap_cache();
+
+	auto f = ldap_cache.find(key);
+
+	if (f == ldap_cache.end())
+		return false;
+
+	if (ldap_user_expired(f->second, cache_now())) {
+		ldap_cache.erase(f);
+		return false;
+	}
+
+	name = f->second.name;
+	email = f->second.email;
+
+	return true;
+}
+
+static void cache_user(string_view key, const string& name, const string& email) {
+	ldap_user u{name, email, cache_now()};
+
+	append_ldap_cache(ldap_user_json(key, u));
+	ldap_cache.insert_or_assign(string(key), move(u));
+}
+
+// Binding is expensive, so we keep the one session for the lifetime of the process.
+static ldapobj& ldap_session() {
+	static unique_ptr<ldapobj> l;
+
+	if (!l)
+		l = make_unique<ldapobj>();
+
+	return *l;
+}
+
+static void user_details(const map<string, string>& ret, string& name, string& email) {
+	if (ret.count("givenName") != 0 && ret.count("sn") != 0)
+		name = ret.at("givenName") + " " + ret.at("sn");
+	else if (ret.count("name") != 0)
+		name = ret.at("name");
+	else
+		name = "";
+
+	if (ret.count("mail") != 0)
+		email = ret.at("mail");
+	else
+		email = "";
+}
+
+// escape value for use in search filter, as per RFC 4515
+static string filter_escape(string_view s) {
+	string ret;
+
+	ret.reserve(s.size());
+
+	for (auto c : s) {
+		switch (c) {
+			case '*':
+				ret += "\\2a";
+				break;
+
+			case '(':
+				ret += "\\28";
+				break;
+
+			case ')':
+				ret += "\\29";
+				break;
+
+			case '\\':
+				ret += "\\5c";
+				break;
+
+			case 0:
+				ret += "\\00";
+				break;
+
+			default:
+				ret += c;
+		}
+	}
+
+	return ret;
+}
+
 #ifdef _WIN32
 
 static string hex_byte(uint8_t v) {
@@ -282,19 +607,6 @@ static string hex_byte(uint8_t v) {
 
 void get_ldap_details_from_sid(PSID sid, string& name, string& email) {
 	span sidsp((const uint8_t*)sid, GetLengthSid(sid));
-
-	// FIXME - is there an easy way to have vector<uint8_t> as the map key rather than string?
-
-	if (auto f = ldap_cache.find(string_view((char*)sidsp.data(), sidsp.size())); f != ldap_cache.end()) {
-		const auto& p = *f;
-
-		name = p.second.first;
-		email = p.second.second;
-
-		return;
-	}
-
-	ldapobj l;
 	string binsid;
 
 	binsid.reserve(3 * sidsp.size());
@@ -303,33 +615,29 @@ void get_ldap_details_from_sid(PSID sid, string& name, string& email) {
 		binsid += hex_byte(b);
 	}
 
-	auto ret = l.search("(objectSid=" + binsid + ")", { "givenName", "sn", "name", "mail" });
+	if (find_cached_user(binsid, name, email))
+		return;
 
-	if (ret.count("givenName") != 0 && ret.count("sn") != 0)
-		name = ret.at("givenName") + " " + ret.at("sn");
-	else if (ret.count("name") != 0)
-		name = ret.at("name");
-	else
-		name = "";
+	auto& l = ldap_session();
 
-	if (ret.count("mail") != 0)
-		email = ret.at("mail");
-	else
-		email = "";
+	auto ret = l.search("(objectSid=" + binsid + ")", { "givenName", "sn", "name", "mail" });
+
+	user_details(ret, name, email);
 
-	ldap_cache.try_emplace(string((char*)sidsp.data(), (char*)sidsp.data() + sidsp.size()), make_pair(name, email));
+	cache_user(binsid, name, email);
 }
 
 #else
 
 static string resolve_netbios_domain(ldapobj& l, string_view domain) {
 	if (auto f = ldap_domain.find(domain); f != ldap_domain.end()) {
-		const auto& p = *f;
+		if (cache_now() - f->second.time < ldap_cache_ttl)
+			return f->second.context;
 
-		return p.second;
+		ldap_domain.erase(f);
 	}
 
-	auto res = l.search_context("(nETBIOSName=" + string(domain) + ")", { "nCName" },
+	auto res = l.search_context("(nETBIOSName=" + filter_escape(domain) + ")", { "nCName" },
 								"CN=Partitions,CN=Configuration," + l.naming_context);
 
 	if (!res.contains("nCName"))
@@ -337,23 +645,140 @@ static string resolve_netbios_domain(ldapobj& l, string_view domain) {
 
 	const auto& ret = res.at("nCName");
 
-	ldap_domain.try_emplace(string(domain), ret);
+	ldap_naming_context d{ret, cache_now()};
+
+	append_ldap_cache(ldap_domain_json(domain, d));
+	ldap_domain.insert_or_assign(string(domain), move(d));
 
 	return ret;
 }
 
-void get_ldap_details_from_full_name(string_view username, string& name, string& email) {
-	if (auto f = ldap_cache.find(username); f != ldap_cache.end()) {
-		const auto& p = *f;
+struct ldap_prefetch {
+	int msgid;
+	string nbdomain;
+	vector<string> usernames;
+};
+
+static vector<ldap_prefetch> ldap_prefetches;
+
+static string ascii_lower(string_view s) {
+	string ret{s};
+
+	for (auto& c : ret) {
+		if (c >= 'A' && c <= 'Z')
+			c = c - 'A' + 'a';
+	}
+
+	return ret;
+}
 
-		name = p.second.first;
-		email = p.second.second;
+// Sends off searches for DOMAIN\user names we don't already know about, one per domain with an
+// OR filter. The results are collected by finish_ldap_prefetch, so the caller can get on with
+// something else in the meantime.
+void prefetch_ldap_details(span<const string> usernames) {
+	map<string, vector<string>> by_domain;
 
+	for (const auto& u : usernames) {
+		string name, email;
+
+		auto bs = u.find("\\");
+
+		if (bs == string::npos)
+			continue;
+
+		if (find_cached_user(u, name, email))
+			continue;
+
+		by_domain[u.substr(0, bs)].push_back(u);
+	}
+
+	if (by_domain.empty())
+		return;
+
+	auto& l = ldap_session();
+
+	for (const auto& [nbdomain, users] : by_domain) {
+		auto domain = resolve_netbios_domain(l, nbdomain);
+
+		// keep filters to a sensible length
+		for (size_t i = 0; i < users.size(); i += 100) {
+			ldap_prefetch p;
+			string filter = "(|";
+
+			p.nbdomain = nbdomain;
+
+			for (size_t j = i; j < min(users.size(), i + 100); j++) {
+				filter += "(sAMAccountName=" + filter_escape(string_view(users[j]).substr(nbdomain.size() + 1)) + ")";
+				p.usernames.push_back(users[j]);
+			}
+
+			filter += ")";
+
+			p.msgid = l.search_async(filter, { "sAMAccountName", "givenName", "sn", "name", "mail" }, domain);
+
+			ldap_prefetches.push_back(move(p));
+		}
+	}
+}
+
+static void finish_ldap_prefetch() {
+	if (ldap_prefetches.empty())
 		return;
+
+	auto prefetches = move(ldap_prefetches);
+
+	ldap_prefetches.clear();
+
+	auto& l = ldap_session();
+
+	for (const auto& p : prefetches) {
+		unordered_map<string, string> users;
+
+		for (const auto& u : p.usernames) {
+			users.emplace(ascii_lower(string_view(u).substr(p.nbdomain.size() + 1)), u);
+		}
+
+		try {
+			auto entries = l.search_result(p.msgid);
+
+			for (const auto& e : entries) {
+				auto f = e.find("sAMAccountName");
+
+				if (f == e.end())
+					continue;
+
+				auto u = users.find(ascii_lower(f->second));
+
+				if (u == users.end())
+					continue;
+
+				string name, email;
+
+				user_details(e, name, email);
+				cache_user(u->second, name, email);
+
+				users.erase(u);
+			}
+
+			// anything left over doesn't exist
+			for (const auto& u : users) {
+				cache_user(u.second, "", "");
+			}
+		} catch (const exception& e) {
+			cerr << "LDAP prefetch failed: " << e.what() << endl;
+		}
 	}
+}
+
+void get_ldap_details_from_full_name(string_view username, string& name, string& email) {
+	finish_ldap_prefetch();
+
+	if (find_cached_user(username, name, email))
+		return;
 
-	ldapobj l;
+	auto& l = ldap_session();
 	string_view nbdomain;
+	string full_name{username};
 
 	if (auto bs = username.find("\\"); bs != string::npos) {
 		nbdomain = username.substr(0, bs);
@@ -363,51 +788,27 @@ void get_ldap_details_from_full_name(string_view username, string& name, string&
 
 	auto domain = resolve_netbios_domain(l, nbdomain);
 
-	auto ret = l.search_context("(sAMAccountName=" + string(username) + ")", { "givenName", "sn", "name", "mail" },
+	auto ret = l.search_context("(sAMAccountName=" + filter_escape(username) + ")", { "givenName", "sn", "name", "mail" },
 								domain);
 
-	if (ret.count("givenName") != 0 && ret.count("sn") != 0)
-		name = ret.at("givenName") + " " + ret.at("sn");
-	else if (ret.count("name") != 0)
-		name = ret.at("name");
-	else
-		name = "";
-
-	if (ret.count("mail") != 0)
-		email = ret.at("mail");
-	else
-		email = "";
+	user_details(ret, name, email);
 
-	ldap_cache.try_emplace(string(username), make_pair(name, email));
+	cache_user(full_name, name, email);
 }
 
 void get_ldap_details_from_name(string_view username, string& name, string& email) {
-	if (auto f = ldap_cache.find(username); f != ldap_cache.end()) {
-		const auto& p = *f;
-
-		name = p.second.first;
-		email = p.second.second;
+	finish_ldap_prefetch();
 
+	if (find_cached_user(username, name, email))
 		return;
-	}
-
-	ldapobj l;
 
-	auto ret = l.search("(sAMAccountName=" + string(username) + ")", { "givenName", "sn", "name", "mail" });
+	auto& l = ldap_session();
 
-	if (ret.count("givenName") != 0 && ret.count("sn") != 0)
-		name = ret.at("givenName") + " " + ret.at("sn");
-	else if (ret.count("name") != 0)
-		name = ret.at("name");
-	else
-		name = "";
+	auto ret = l.search("(sAMAccountName=" + filter_escape(username) + ")", { "givenName", "sn", "name", "mail" });
 
-	if (ret.count("mail") != 0)
-		email = ret.at("mail");
-	else
-		email = "";
+	user_details(ret, name, email);
 
-	ldap_cache.try_emplace(string(username), make_pair(name, email));
+	cache_user(username, name, email);
 }
 
 #endif
@@ -9,25 +9,7 @@ static enum lex identify_word(string_view s) {
     if (s[0] == '[')
         return lex::identifier;
 
-    string t;
-
-    t.reserve(s.size());
-
-    for (auto c : s) {
-        if (c >= 'a' && c <= 'z')
-            t += c - 'a' + 'A';
-        else if ((c >= 'A' && c <= 'Z') || c == '_')
-            t += c;
-        else
-            return lex::identifier;
-    }
-
-    for (const auto& rw : reserved_words) {
-        if (rw.s == t)
-            return rw.type;
-    }
-
-    return lex::identifier;
+    return keyword_type(s);
 }
 
 // FIXME - make this constexpr and add static_assert tests
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <string>
 #include <string_view>
 #include <list>
+#include <array>
+#include <iterator>
+#include <type_traits>
+#include <stdint.h>
 
 enum class lex {
     whitespace,
@@ -211,7 +216,7 @@ enum class lex {
     WRITETEXT,
 };
 
-static const struct {
+static constexpr struct {
     std::string_view s;
     enum lex type;
 } reserved_words[] = {
@@ -396,6 +401,171 @@ static const struct {
     { "WRITETEXT", lex::WRITETEXT },
 };
 
+// Identifier classification, shared by the lexer and by the code which adds
+// and removes brackets. Everything below is constexpr, works for both char and
+// char16_t, and never allocates.
+
+static constexpr uint8_t cc_keyword = 1; // can appear in a reserved word
+static constexpr uint8_t cc_ident = 2; // can appear in an unquoted identifier
+static constexpr uint8_t cc_start = 4; // can begin an unquoted identifier
+
+// see https://docs.microsoft.com/en-us/previous-versions/sql/sql-server-2008-r2/ms175874(v=sql.105)
+static constexpr auto ident_char_classes = [] {
+    std::array<uint8_t, 128> t{};
+
+    for (unsigned int c = 'A'; c <= 'Z'; c++) {
+        t[c] = cc_keyword | cc_ident | cc_start;
+        t[c - 'A' + 'a'] = cc_keyword | cc_ident | cc_start;
+    }
+
+    for (unsigned int c = '0'; c <= '9'; c++) {
+        t[c] = cc_ident;
+    }
+
+    t['_'] = cc_keyword | cc_ident | cc_start;
+    t['#'] = cc_ident | cc_start;
+
+    // can't have number, dollar sign, or at sign at beginning
+    t['$'] = cc_ident;
+    t['@'] = cc_ident;
+
+    return t;
+}();
+
+template<typename T>
+static constexpr uint8_t char_class(T c) {
+    auto u = static_cast<std::make_unsigned_t<T>>(c);
+
+    return u < ident_char_classes.size() ? ident_char_classes[u] : 0;
+}
+
+// Reserved words are found by a perfect hash: the seed was chosen so that no
+// two entries of reserved_words land in the same slot, which is checked
+// when keyword_slots is built. If you add a reserved word and the build
+// breaks, pick a new seed.
+
+static constexpr uint32_t keyword_hash_seed = 2769;
+static constexpr size_t keyword_hash_size = 2048;
+
+template<typename T>
+static constexpr size_t keyword_hash(std::basic_string_view<T> s) {
+    uint32_t h = keyword_hash_seed;
+
+    for (auto c : s) {
+        auto u = static_cast<uint32_t>(c);
+
+        if (u >= 'a' && u <= 'z')
+            u -= 'a' - 'A';
+
+        h = (h * 31) + u;
+    }
+
+    h ^= h >> 16;
+
+    return h % keyword_hash_size;
+}
+
+static_assert(std::size(reserved_words) < 0xff);
+
+// index into reserved_words plus one, or zero for an empty slot
+static constexpr auto keyword_slots = [] {
+    std::array<uint8_t, keyword_hash_size> t{};
+
+    for (size_t i = 0; i < std::size(reserved_words); i++) {
+        auto& slot = t[keyword_hash(reserved_words[i].s)];
+
+        if (slot != 0)
+            throw "keyword_hash_seed does not give a perfect hash";
+
+        slot = static_cast<uint8_t>(i + 1);
+    }
+
+    return t;
+}();
+
+// Returns the type of the reserved word s, ignoring case, or lex::identifier if it isn't one.
+template<typename T>
+static constexpr enum lex keyword_type(std::basic_string_view<T> s) {
+    for (auto c : s) {
+        if (!(char_class(c) & cc_keyword))
+            return lex::identifier;
+    }
+
+    auto slot = keyword_slots[keyword_hash(s)];
+
+    if (slot == 0)
+        return lex::identifier;
+
+    const auto& rw = reserved_words[slot - 1];
+
+    if (rw.s.size() != s.size())
+        return lex::identifier;
+
+    for (size_t i = 0; i < s.size(); i++) {
+        auto c = s[i];
+
+        if (c >= 'a' && c <= 'z')
+            c -= 'a' - 'A';
+
+        if (c != static_cast<T>(rw.s[i]))
+            return lex::identifier;
+    }
+
+    return rw.type;
+}
+
+template<typename T>
+static constexpr bool is_reserved_word(std::basic_string_view<T> s) {
+    return keyword_type(s) != lex::identifier;
+}
+
+template<typename T>
+static constexpr bool need_escaping(std::basic_string_view<T> s) {
+    if (s.empty() || !(char_class(s.front()) & cc_start))
+        return true;
+
+    for (auto c : s) {
+        if (!(char_class(c) & cc_ident))
+            return true;
+    }
+
+    return is_reserved_word(s);
+}
+
+// Appends s to out, surrounded by brackets if it needs them.
+template<typename T>
+static constexpr void brackets_escape_append(std::basic_string<T>& out, std::type_identity_t<std::basic_string_view<T>> s) {
+    if (!need_escaping(s)) {
+        out.append(s);
+        return;
+    }
+
+    out.reserve(out.size() + s.size() + 2);
+    out.push_back('[');
+
+    for (auto c : s) {
+        if (c == ']')
+            out.push_back(']');
+
+        out.push_back(c);
+    }
+
+    out.push_back(']');
+}
+
+static_assert(keyword_type(std::string_view{"select"}) == lex::SELECT);
+static_assert(keyword_type(std::u16string_view{u"Delete"}) == lex::SQL_DELETE);
+static_assert(keyword_type(std::string_view{"SELECTS"}) == lex::identifier);
+static_assert(keyword_type(std::string_view{"caf\xc3\xa9"}) == lex::identifier);
+static_assert(!need_escaping(std::string_view{"foo_1"}));
+static_assert(!need_escaping(std::u16string_view{u"#temp"}));
+static_assert(need_escaping(std::string_view{""}));
+static_assert(need_escaping(std::string_view{"1foo"}));
+static_assert(need_escaping(std::string_view{"@foo"}));
+static_assert(need_escaping(std::string_view{"foo bar"}));
+static_assert(need_escaping(std::u16string_view{u"caf\u00e9"}));
+static_assert(need_escaping(std::string_view{"table"}));
+
 struct word {
 	word(enum lex type, std::string_view val) : type(type), val(val) { }
 
@@ -357,7 +357,7 @@ void dump_master(string_view db_server, unsigned int repo_num, span<const std::b
 		opts.db = "master";
 
 		tds::tds tds(opts);
-		do_dump_sql(tds, gu);
+		do_dump_sql(tds, gu, "master");
 	}
 
 	string name, email;
@@ -97,50 +97,6 @@ string munge_definition(string_view sql, string_view schema, string_view name,
 	return sql2;
 }
 
-static bool is_reserved(string_view sv) {
-	string s;
-
-	s.reserve(sv.size());
-
-	for (auto c : sv) {
-		if (c >= 'a' && c <= 'z')
-			s += c - 'a' + 'A';
-		else if ((c >= 'A' && c <= 'Z') || c == '_')
-			s += c;
-		else
-			return false;
-	}
-
-	for (const auto& rw : reserved_words) {
-		if (rw.s == s)
-			return true;
-	}
-
-	return false;
-}
-
-static bool needs_escaping(string_view s) {
-	if (s.empty())
-		return true;
-
-	for (auto c : s) {
-		if ((c < 'A' || c > 'Z') && (c < 'a' || c > 'z') && (c < '0' || c > '9') && c != '_' && c != '@' && c != '#' && c != '$')
-			return true;
-	}
-
-	// can't have number or dollar sign at beginning
-
-	if ((s.front() >= '0' && s.front() <= '9') || s.front() == '$')
-		return true;
-
-	// would change meaning if not escaped
-
-	if (s.front() == '@')
-		return true;
-
-	return false;
-}
-
 static bool is_wordlike(enum lex l) {
 	switch (l) {
 		case lex::whitespace:
@@ -190,7 +146,7 @@ string dequote(string_view sql) {
 			string s;
 			string_view sv = w.val.substr(1, w.val.size() - 2);
 
-			if (is_reserved(sv) || needs_escaping(sv))
+			if (need_escaping(sv))
 				ret.append(w.val);
 			else {
 				if (it != words.begin()) {
@@ -15,85 +15,22 @@
 
 using namespace std;
 
-static const vector<u16string_view> reserved_words16{u"ADD", u"ALL", u"ALTER", u"AND", u"ANY", u"AS", u"ASC", u"AUTHORIZATION", u"BACKUP", u"BEGIN", u"BETWEEN", u"BREAK", u"BROWSE", u"BULK", u"BY", u"CASCADE", u"CASE", u"CHECK", u"CHECKPOINT", u"CLOSE", u"CLUSTERED", u"COALESCE", u"COLLATE", u"COLUMN", u"COMMIT", u"COMPUTE", u"CONSTRAINT", u"CONTAINS", u"CONTAINSTABLE", u"CONTINUE", u"CONVERT", u"CREATE", u"CROSS", u"CURRENT", u"CURRENT_DATE", u"CURRENT_TIME", u"CURRENT_TIMESTAMP", u"CURRENT_USER", u"CURSOR", u"DATABASE", u"DBCC", u"DEALLOCATE", u"DECLARE", u"DEFAULT", u"DELETE", u"DENY", u"DESC", u"DISTINCT", u"DISTRIBUTED", u"DOUBLE", u"DROP", u"ELSE", u"END", u"ERRLVL", u"ESCAPE", u"EXCEPT", u"EXEC", u"EXECUTE", u"EXISTS", u"EXIT", u"EXTERNAL", u"FETCH", u"FILE", u"FILLFACTOR", u"FOR", u"FOREIGN", u"FREETEXT", u"FREETEXTTABLE", u"FROM", u"FULL", u"FUNCTION", u"GOTO", u"GRANT", u"GROUP", u"HAVING", u"HOLDLOCK", u"IDENTITY", u"IDENTITY_INSERT", u"IDENTITYCOL", u"IF", u"IN", u"INDEX", u"INNER", u"INSERT", u"INTERSECT", u"INTO", u"IS", u"JOIN", u"KEY", u"KILL", u"LEFT", u"LIKE", u"LINENO", u"MERGE", u"NATIONAL", u"NOCHECK", u"NONCLUSTERED", u"NOT", u"NULL", u"NULLIF", u"OF", u"OFF", u"OFFSETS", u"ON", u"OPEN", u"OPENDATASOURCE", u"OPENQUERY", u"OPENROWSET", u"OPENXML", u"OPTION", u"OR", u"ORDER", u"OUTER", u"OVER", u"PERCENT", u"PIVOT", u"PLAN", u"PRIMARY", u"PRINT", u"PROC", u"PROCEDURE", u"PUBLIC", u"RAISERROR", u"READ", u"READTEXT", u"RECONFIGURE", u"REFERENCES", u"REPLICATION", u"RESTORE", u"RESTRICT", u"RETURN", u"REVERT", u"REVOKE", u"RIGHT", u"ROLLBACK", u"ROWCOUNT", u"ROWGUIDCOL", u"RULE", u"SAVE", u"SCHEMA", u"SELECT", u"SEMANTICKEYPHRASETABLE", u"SEMANTICSIMILARITYDETAILSTABLE", u"SEMANTICSIMILARITYTABLE", u"SESSION_USER", u"SET", u"SETUSER", u"SHUTDOWN", u"SOME", u"STATISTICS", u"SYSTEM_USER", u"TABLE", u"TABLESAMPLE", u"TEXTSIZE", u"THEN", u"TO", u"TOP", u"TRAN", u"TRANSACTION", u"TRIGGER", u"TRUNCATE", u"TRY_CONVERT", u"TSEQUAL", u"UNION", u"UNIQUE", u"UNPIVOT", u"UPDATE", u"UPDATETEXT", u"USE", u"USER", u"VALUES", u"VARYING", u"VIEW", u"WAITFOR", u"WHEN", u"WHERE", u"WHILE", u"WITH", u"WRITETEXT"};
-
-template<typename T>
-static bool is_reserved_word(const basic_string_view<T>& sv) {
-	auto s = basic_string<T>(sv);
-
-	for (auto& c : s) {
-		if (c >= 'a' && c <= 'z')
-			c += 'A' - 'a';
-		else if ((c < 'A' || c > 'Z') && c != '_')
-			return false;
-	}
-
-	if constexpr (is_same_v<T, char>) {
-		for (const auto& w : reserved_words) {
-			if (w.s == s)
-				return true;
-		}
-	} else if constexpr (is_same_v<T, char16_t>) {
-		for (const auto& w : reserved_words16) {
-			if (w == s)
-				return true;
-		}
-	}
-
-	return false;
-}
-
-template<typename T>
-static bool need_escaping(const basic_string_view<T>& s) {
-	// see https://docs.microsoft.com/en-us/previous-versions/sql/sql-server-2008-r2/ms175874(v=sql.105)
-
-	if (s.empty())
-		return true;
-
-	for (auto c : s) {
-		if ((c < 'A' || c > 'Z') && (c < 'a' || c > 'z') && (c < '0' || c > '9') && c != '_' && c != '@' && c != '#' && c != '$')
-			return true;
-	}
-
-	// can't have number, dollar sign, or at sign at beginning
+string brackets_escape(string_view s) {
+	string ret;
 
-	if ((s.front() >= '0' && s.front() <= '9') || s.front() == '$' || s.front() == '@')
-		return true;
+	brackets_escape_append(ret, s);
 
-	return is_reserved_word(s);
+	return ret;
 }
 
-template<typename T>
-static basic_string<T> brackets_escape2(const basic_string_view<T>& s) {
-	basic_string<T> ret;
-
-	if (!need_escaping(s))
-		return basic_string<T>(s);
-
-	ret.reserve(s.length() + 2);
-	ret.push_back('[');
-
-	for (auto c : s) {
-		if (c == ']') {
-			ret.push_back(']');
-			ret.push_back(']');
-		} else
-			ret.push_back(c);
-	}
+u16string brackets_escape(u16string_view s) {
+	u16string ret;
 
-	ret.push_back(']');
+	brackets_escape_append(ret, s);
 
 	return ret;
 }
 
-string brackets_escape(string_view s) {
-	return brackets_escape2(s);
-}
-
-u16string brackets_escape(u16string_view s) {
-	return brackets_escape2(s);
-}
-
 struct column {
 	column(const string& name, const string& type, int max_length, bool nullable, int precision,
 		   int scale, const tds::value& def, unsigned int column_id, bool is_identity, bool is_computed,
@@ -204,7 +141,7 @@ static string dump_table(tds::tds& tds, const string& escaped_name) {
 				if (!cols.empty())
 					cols += ", ";
 
-				cols += brackets_escape(tds::utf16_to_utf8(col.name));
+				brackets_escape_append(cols, tds::utf16_to_utf8(col.name));
 			}
 		}
 
@@ -247,7 +184,7 @@ static string index_data_space(const table_index& ind) {
 		if (!first)
 			ret += ", ";
 
-		ret += brackets_escape(c.second);
+		brackets_escape_append(ret, c.second);
 
 		first = false;
 	}
@@ -669,7 +606,7 @@ ORDER BY foreign_key_columns.constraint_object_id, foreign_key_columns.constrain
 
 				first = false;
 
-				ddl += brackets_escape(col.col.name);
+				brackets_escape_append(ddl, col.col.name);
 
 				if (col.is_desc)
 					ddl += " DESC";
@@ -696,7 +633,7 @@ ORDER BY foreign_key_columns.constraint_object_id, foreign_key_columns.constrain
 
 				first = false;
 
-				ddl += brackets_escape(c.col.name);
+				brackets_escape_append(ddl, c.col.name);
 			}
 
 			ddl += ") REFERENCES " + brackets_escape(fk.cols.front().schema) + "." + brackets_escape(fk.cols.front().table) + "(";
@@ -709,7 +646,7 @@ ORDER BY foreign_key_columns.constraint_object_id, foreign_key_columns.constrain
 
 				first = false;
 
-				ddl += brackets_escape(c.other_column);
+				brackets_escape_append(ddl, c.other_column);
 			}
 
 			ddl += ")";
@@ -771,7 +708,7 @@ ORDER BY foreign_key_columns.constraint_object_id, foreign_key_columns.constrain
 
 						first = false;
 
-						ddl += brackets_escape(col.col.name);
+						brackets_escape_append(ddl, col.col.name);
 
 						if (col.is_desc)
 							ddl += " DESC";
@@ -793,7 +730,7 @@ ORDER BY foreign_key_columns.constraint_object_id, foreign_key_columns.constrain
 
 							first = false;
 
-							ddl += brackets_escape(col.col.name);
+							brackets_escape_append(ddl, col.col.name);
 
 							if (col.is_desc)
 								ddl += " DESC";
@@ -988,7 +925,7 @@ ORDER BY stats.name,
 				if (!first2)
 					ddl += ", ";
 
-				ddl += brackets_escape(c);
+				brackets_escape_append(ddl, c);
 				first2 = false;
 			}
 